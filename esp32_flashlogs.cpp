@@ -30,6 +30,939 @@
 
 #include "esp32_flashlogs.h"
 #include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
+#include <new>
+#ifdef ESP_PLATFORM
+#include <esp_attr.h>
+#include <esp_idf_version.h>
+#if ESP_IDF_VERSION_MAJOR >= 5
+#include <esp_cpu.h>
+#define esp_cpu_get_ccount esp_cpu_get_cycle_count
+#define flashlog_munmap esp_partition_munmap
+#else
+#include <soc/cpu.h>
+#define ESP_PARTITION_MMAP_DATA SPI_FLASH_MMAP_DATA
+#define flashlog_munmap spi_flash_munmap
+typedef spi_flash_mmap_handle_t esp_partition_mmap_handle_t;
+#endif
+#include <esp_rom_crc.h>
+#define flashlog_crc32 esp_rom_crc32_le
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#else
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#define RTC_NOINIT_ATTR // no RTC memory, so just use a static variable
+#define flashlog_munmap esp_partition_munmap
+
+// The same CRC-32 as the ESP32 ROM's crc32_le, which is the usual one, so that logs can be
+// checked on either. The instruction that some processors have for CRCs uses a different
+// polynomial, so we use tables for doing 8 bytes at a time ("slicing-by-8").
+static uint32_t crc_table[8][256];
+
+static bool
+crc_init (void) {
+   for (int i = 0; i < 256; ++i) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; ++k)
+         c = c & 1 ? (c >> 1) ^ 0xedb88320 : c >> 1;
+      crc_table[0][i] = c; }
+   for (int i = 0; i < 256; ++i)
+      for (int t = 1; t < 8; ++t)
+         crc_table[t][i] = (crc_table[t - 1][i] >> 8) ^ crc_table[0][crc_table[t - 1][i] & 0xff];
+   return true; }
+
+static uint32_t
+flashlog_crc32 (uint32_t crc, const uint8_t *buf, uint32_t len) {
+   static const bool ready = crc_init(); // only once, even with several threads
+   (void)ready;
+   crc = ~crc;
+   for (; len >= 8; len -= 8, buf += 8) { // assuming a little-endian host
+      uint32_t lo, hi;
+      memcpy(&lo, buf, 4);
+      memcpy(&hi, buf + 4, 4);
+      lo ^= crc;
+      crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^ crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24]
+            ^ crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^ crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24]; }
+   while (len--)
+      crc = (crc >> 8) ^ crc_table[0][(crc ^ *buf++) & 0xff];
+   return ~crc; }
+#endif
+
+// The queue and writer task for asynchronous adds. The queue holds complete entries,
+// header and data, so the writer can write them directly. The queue lock protects
+// the queue, and is held only briefly; the state lock protects the rest of the state
+// structure, and is held by the writer while it writes an entry.
+struct flashlog_async_t {
+   char *queue;              // queuesize entries
+   int queuesize;            // how many entries the queue can hold
+   int head, count;          // the oldest queued entry, and how many there are
+   enum flashlog_error err;  // the first error from the writer since the last flush
+   bool stop, running;       // tell the writer to stop, and whether it is still running
+#ifdef ESP_PLATFORM
+   SemaphoreHandle_t queue_lock, state_lock;
+   TaskHandle_t task;
+#else
+   std::mutex queue_lock, state_lock;
+   std::condition_variable changed; // signalled when the queue changes
+   std::thread task;
+#endif
+};
+
+static void
+state_lock (struct flashlog_state_t *state) {
+   if (state->async)
+#ifdef ESP_PLATFORM
+      xSemaphoreTake(state->async->state_lock, portMAX_DELAY);
+#else
+      state->async->state_lock.lock();
+#endif
+}
+
+static void
+state_unlock (struct flashlog_state_t *state) {
+   if (state->async)
+#ifdef ESP_PLATFORM
+      xSemaphoreGive(state->async->state_lock);
+#else
+      state->async->state_lock.unlock();
+#endif
+}
+
+// FLASHLOG_OPT_COMPRESS compresses entries with a small LZ77 compressor, in the style of
+// LZ4. The compressed data is a series of sequences, each a token byte, some literal bytes
+// to copy, and then a match: a 2-byte distance back to earlier data, or into the dictionary
+// before it, to copy from. The high 4 bits of the token are the number of literals and the
+// low 4 the match length less FLASHLOG_LZ_MINMATCH; 15 means that more bytes follow, to be
+// added to it, until one isn't 255. The last sequence has only literals. The compressor
+// finds matches with hash tables of where each 3 bytes were last seen, one for the entry and
+// one made when the dictionary is given, and takes the longer match of the two.
+#define FLASHLOG_LZ_MINMATCH 3
+#define FLASHLOG_LZ_HASHBITS 9
+struct flashlog_lz_t {
+   const uint8_t *dict;                         // the dictionary, or NULL
+   int dictlen;                                 // and its length
+   uint16_t table[1 << FLASHLOG_LZ_HASHBITS];   // where in the entry each hash was last seen, plus 1
+   uint16_t dict_table[1 << FLASHLOG_LZ_HASHBITS]; // where in the dictionary, plus 1
+   struct flashlog_entry_hdr_t *entry; };       // a buffer for a compressed entry, after this
+
+static int
+lz_hash (const uint8_t *p) {
+   return (uint32_t)(p[0] | p[1] << 8 | p[2] << 16) * 2654435761u >> (32 - FLASHLOG_LZ_HASHBITS); }
+
+// how many bytes at "p" and "q" are the same, up to "max"
+static int
+lz_match (const uint8_t *p, const uint8_t *q, int max) {
+   int n = 0;
+   while (n < max && p[n] == q[n]) ++n;
+   return n; }
+
+// add the bytes of a length that doesn't fit in its 4 bits of the token
+static bool
+lz_put_length (uint8_t *out, int *o, int max, int n) {
+   for (; n >= 255; n -= 255) {
+      if (*o >= max) return false;
+      out[(*o)++] = 255; }
+   if (*o >= max) return false;
+   out[(*o)++] = (uint8_t)n;
+   return true; }
+
+static int
+lz_get_length (const uint8_t *in, int *i, int length, int n) {
+   int byte;
+   do {
+      if (*i >= length) return -1;
+      n += byte = in[(*i)++]; }
+   while (byte == 255);
+   return n; }
+
+// Compress "length" bytes at "in" into "out", which has room for "max" bytes. Return the
+// compressed length, or -1 if it would be more than that.
+static int
+lz_compress (struct flashlog_lz_t *lz, const uint8_t *in, int length, uint8_t *out, int max) {
+   int o = 0, literals = 0; // the literals waiting to be written end at "i"
+   memset(lz->table, 0, sizeof(lz->table));
+   for (int i = 0; i <= length; ) {
+      int best = 0, distance = 0;
+      if (i + FLASHLOG_LZ_MINMATCH <= length) {
+         int h = lz_hash(in + i);
+         int from = lz->table[h] - 1;
+         lz->table[h] = i + 1;
+         if (from >= 0 && (best = lz_match(in + from, in + i, length - i)) >= FLASHLOG_LZ_MINMATCH)
+            distance = i - from;
+         else best = 0;
+         if (lz->dict && (from = lz->dict_table[h] - 1) >= 0) { // a match in the dictionary must end there
+            int n = lz_match(lz->dict + from, in + i, lz->dictlen - from < length - i ? lz->dictlen - from : length - i);
+            if (n >= FLASHLOG_LZ_MINMATCH && n > best) {
+               best = n;
+               distance = i + lz->dictlen - from; } } }
+      if (best == 0 && i < length) {
+         ++literals, ++i;
+         continue; }
+      // write a sequence: the token, the literals, and the match, unless this is the end
+      int extra = best - FLASHLOG_LZ_MINMATCH;
+      if (o >= max) return -1;
+      out[o++] = (uint8_t)((literals < 15 ? literals : 15) << 4 | (best == 0 ? 0 : extra < 15 ? extra : 15));
+      if (literals >= 15 && !lz_put_length(out, &o, max, literals - 15)) return -1;
+      if (o + literals > max) return -1;
+      memcpy(out + o, in + i - literals, literals);
+      o += literals;
+      literals = 0;
+      if (best == 0) break;
+      if (o + 2 > max) return -1;
+      out[o++] = (uint8_t)distance;
+      out[o++] = (uint8_t)(distance >> 8);
+      if (extra >= 15 && !lz_put_length(out, &o, max, extra - 15)) return -1;
+      for (int j = i + 1; j < i + best && j + FLASHLOG_LZ_MINMATCH <= length; ++j)
+         lz->table[lz_hash(in + j)] = j + 1; // so later matches can start inside this one
+      i += best; }
+   return o; }
+
+// Decompress "length" bytes at "in" into "out", which has room for "max" bytes. Return the
+// decompressed length, or -1 if the data is damaged.
+static int
+lz_decompress (struct flashlog_lz_t *lz, const uint8_t *in, int length, uint8_t *out, int max) {
+   int i = 0, o = 0;
+   while (i < length) {
+      int token = in[i++];
+      int literals = token >> 4;
+      if (literals == 15 && (literals = lz_get_length(in, &i, length, literals)) < 0) return -1;
+      if (literals > length - i || literals > max - o) return -1;
+      memcpy(out + o, in + i, literals);
+      i += literals;
+      o += literals;
+      if (i == length) break; // the last sequence has no match
+      if (i + 2 > length) return -1;
+      int distance = in[i] | in[i + 1] << 8;
+      i += 2;
+      int n = (token & 15) + FLASHLOG_LZ_MINMATCH;
+      if ((token & 15) == 15 && (n = lz_get_length(in, &i, length, n)) < 0) return -1;
+      if (distance == 0 || distance > o + lz->dictlen || n > max - o) return -1;
+      for (int j = 0; j < n; ++j, ++o) // a byte at a time, since a match can overlap what it makes
+         out[o] = distance > o ? lz->dict[lz->dictlen - (distance - o)] : out[o - distance]; }
+   return o; }
+
+// The FLASH operations, which are counted if FLASHLOG_STATS is defined.
+
+#ifdef FLASHLOG_STATS
+// a cycle counter for timing things, or on the host, nanoseconds
+static uint32_t
+cycle_count (void) {
+#ifdef ESP_PLATFORM
+   return esp_cpu_get_ccount();
+#else
+   return (uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// count something that took "cycles" in a histogram
+static void
+histogram_add (uint32_t *histogram, uint32_t cycles) {
+   ++histogram[cycles ? 31 - __builtin_clz(cycles) : 0]; }
+#endif
+
+static esp_err_t
+flash_read (struct flashlog_state_t *state, size_t offset, void *buf, size_t size) {
+#ifdef FLASHLOG_STATS
+   ++state->stats.reads;
+   state->stats.read_bytes += size;
+#endif
+   if (state->mapped) { // FLASHLOG_OPT_MMAP: read it through the cache
+      memcpy(buf, state->mapped + offset, size);
+      return ESP_OK; }
+   return esp_partition_read(state->partition, offset, buf, size); }
+
+// the offset in the partition of the sector in the cache, if there is one
+static size_t
+cache_offset (struct flashlog_state_t *state) {
+   return FLASHLOG_SLOT0 + (size_t)state->cached_sector * FLASHLOG_SECTOR; }
+
+static esp_err_t
+flash_write (struct flashlog_state_t *state, size_t offset, const void *buf, size_t size) {
+#ifdef FLASHLOG_STATS
+   ++state->stats.writes;
+   state->stats.write_bytes += size;
+#endif
+   esp_err_t err = esp_partition_write(state->partition, offset, buf, size);
+   if (state->cached_sector >= 0) { // keep the cached sector the same as the FLASH
+      size_t start = offset > cache_offset(state) ? offset : cache_offset(state);
+      size_t end = offset + size < cache_offset(state) + FLASHLOG_SECTOR ? offset + size : cache_offset(state) + FLASHLOG_SECTOR;
+      if (err != ESP_OK && start < end)
+         state->cached_sector = -1;
+      else for (size_t i = start; i < end; ++i) // writing can only clear bits
+            state->sectorbuf[i - cache_offset(state)] &= ((const char *)buf)[i - offset]; }
+   return err; }
+
+static esp_err_t
+flash_erase (struct flashlog_state_t *state, size_t offset, size_t size) {
+#ifdef FLASHLOG_STATS
+   ++state->stats.erases;
+   state->stats.erase_bytes += size;
+#endif
+   if (state->cached_sector >= 0
+         && offset < cache_offset(state) + FLASHLOG_SECTOR && offset + size > cache_offset(state))
+      state->cached_sector = -1;
+   return esp_partition_erase_range(state->partition, offset, size); }
+
+// With FLASHLOG_OPT_CACHE, read from a log sector through the sector cache, which holds
+// the last sector read this way. Otherwise, or if it isn't all in one sector, just read it.
+static esp_err_t
+cached_read (struct flashlog_state_t *state, size_t offset, void *buf, size_t size) {
+   if (!(state->options & FLASHLOG_OPT_CACHE) || !state->sectorbuf || offset < FLASHLOG_SLOT0
+         || (offset - FLASHLOG_SLOT0) % FLASHLOG_SECTOR + size > FLASHLOG_SECTOR)
+      return flash_read(state, offset, buf, size);
+   int sector = (offset - FLASHLOG_SLOT0) / FLASHLOG_SECTOR;
+   if (sector != state->cached_sector) {
+      esp_err_t err;
+      state->cached_sector = -1;
+      if ((err = flash_read(state, FLASHLOG_SLOT0 + (size_t)sector * FLASHLOG_SECTOR, state->sectorbuf, FLASHLOG_SECTOR)) != ESP_OK)
+         return err;
+      state->cached_sector = sector; }
+   memcpy(buf, state->sectorbuf + (offset - FLASHLOG_SLOT0) % FLASHLOG_SECTOR, size);
+   return ESP_OK; }
+
+// Some helpers for the layout of the log. A fixed-size log has one entry per slot. A log of
+// variable-length records (FLASHLOG_OPT_VARLEN) has slots of FLASHLOG_VARLEN_UNIT bytes,
+// and each record occupies as many of them as it needs, so its "slot" is where it starts.
+// Either way an entry never crosses a sector boundary. With FLASHLOG_OPT_SUMMARY the end of
+// each sector is reserved for its summary, and the slots end before that. With
+// FLASHLOG_OPT_COMPACT the slots hold only data; they start after the sequence number of
+// the first one, and are followed by a bitmap of the slots whose data is all 0xff.
+
+static int
+slots_per_sector (struct flashlog_state_t *state) {
+   if (state->options & FLASHLOG_OPT_COMPACT)
+      return (FLASHLOG_SECTOR - FLASHLOG_ENTRY_SEQNO_SIZE) * 8 / (state->slotsize * 8 + 1);
+   return (state->options & FLASHLOG_OPT_SUMMARY ? FLASHLOG_SECTOR - FLASHLOG_SUMMARY_SIZE : FLASHLOG_SECTOR) / state->slotsize; }
+
+// where a slot starts in its sector
+static int
+slot_pos (struct flashlog_state_t *state, int slot) {
+   int first = state->options & FLASHLOG_OPT_COMPACT ? FLASHLOG_ENTRY_SEQNO_SIZE : 0;
+   return first + slot % slots_per_sector(state) * state->slotsize; }
+
+// which slot of its sector starts at "pos"
+static int
+pos_slot (struct flashlog_state_t *state, int pos) {
+   return (pos - slot_pos(state, 0)) / state->slotsize; }
+
+// where the slots of a sector end, and with FLASHLOG_OPT_COMPACT, the bitmap starts
+static int
+sector_end (struct flashlog_state_t *state) {
+   return slot_pos(state, 0) + slots_per_sector(state) * state->slotsize; }
+
+static int
+slot_offset (struct flashlog_state_t *state, int slot) {
+   return FLASHLOG_SLOT0 + slot / slots_per_sector(state) * FLASHLOG_SECTOR + slot_pos(state, slot); }
+
+// the number of slots taken by an entry with "length" bytes of data
+static int
+entry_slots (struct flashlog_state_t *state, int length) {
+   if (!(state->options & FLASHLOG_OPT_VARLEN)) return 1;
+   if (length > state->datasize) length = state->datasize; // don't believe a damaged header
+   return (state->hdrsize + length + FLASHLOG_VARLEN_UNIT - 1) / FLASHLOG_VARLEN_UNIT; }
+
+// the offset in a sector read into memory of the entry after the one at "pos",
+// or FLASHLOG_SECTOR if there isn't room for another one
+static int
+sector_next (struct flashlog_state_t *state, const char *sector, int pos) {
+   pos += entry_slots(state, ((const struct flashlog_entry_hdr_t *)(sector + pos))->length) * state->slotsize;
+   return pos + state->hdrsize > sector_end(state) ? FLASHLOG_SECTOR : pos; }
+
+// The sequence number in an entry header, or UINT32_MAX if the slot is unused, or with
+// FLASHLOG_OPT_COMMIT, if the entry in it was never completely written.
+static uint32_t
+hdr_seqno (struct flashlog_state_t *state, const struct flashlog_entry_hdr_t *hdr) {
+   if ((state->options & FLASHLOG_OPT_COMMIT) && (hdr->flags & FLASHLOG_FLAG_PENDING))
+      return UINT32_MAX;
+   return hdr->seqno; }
+
+// whether "length" bytes are all erased
+static bool
+all_erased (const void *data, int length) {
+   for (int i = 0; i < length; ++i)
+      if (((const uint8_t *)data)[i] != 0xff) return false;
+   return true; }
+
+// The sequence number of the entry at "pos" in a sector read into memory, or UINT32_MAX.
+// With FLASHLOG_OPT_COMPACT it comes from the sector's first sequence number and the
+// slot's place, if the slot's data or its bit in the bitmap says it's used.
+static uint32_t
+sector_seqno (struct flashlog_state_t *state, const char *sector, int pos) {
+   if (!(state->options & FLASHLOG_OPT_COMPACT))
+      return hdr_seqno(state, (const struct flashlog_entry_hdr_t *)(sector + pos));
+   uint32_t base = *(const uint32_t *)sector;
+   int index = pos_slot(state, pos);
+   if (base == UINT32_MAX
+         || (all_erased(sector + pos, state->slotsize) && (sector[sector_end(state) + index / 8] >> (index % 8) & 1)))
+      return UINT32_MAX;
+   return base + index; }
+
+// The CRC of an entry with FLASHLOG_OPT_CRC, which covers everything but the flags, which may
+// be changed after the entry is written, and the CRC itself. The data must follow the header.
+static uint32_t
+entry_crc (struct flashlog_state_t *state, const struct flashlog_entry_hdr_t *entry) {
+   int length = entry->length < state->datasize ? entry->length : state->datasize;
+   uint32_t crc = flashlog_crc32(0, (const uint8_t *)entry, 6); // the seqno and length
+   crc = flashlog_crc32(crc, (const uint8_t *)&entry->timestamp, sizeof(entry->timestamp));
+   return flashlog_crc32(crc, (const uint8_t *)entry + state->hdrsize, length); }
+
+// With FLASHLOG_OPT_COMPACT, find the sequence number of a slot from the sector's first one,
+// checking that it's used unless it's the first slot, which the first one is written with.
+static enum flashlog_error
+compact_seqno (struct flashlog_state_t *state, int slot, uint32_t *seqno) {
+   int sector = FLASHLOG_SLOT0 + slot / slots_per_sector(state) * FLASHLOG_SECTOR;
+   int index = slot % slots_per_sector(state);
+   uint8_t buf[64];
+   bool used = index == 0;
+   if ((state->partition_err = flash_read(state, sector, seqno, sizeof(*seqno))) != ESP_OK)
+      return FLASHLOG_ERR_READERR;
+   for (int done = 0; !used && *seqno != UINT32_MAX && done < state->slotsize; done += sizeof(buf)) {
+      int length = state->slotsize - done < (int)sizeof(buf) ? state->slotsize - done : sizeof(buf);
+      if ((state->partition_err = flash_read(state, slot_offset(state, slot) + done, buf, length)) != ESP_OK)
+         return FLASHLOG_ERR_READERR;
+      used = !all_erased(buf, length); }
+   if (!used && *seqno != UINT32_MAX) { // it might be all 0xff, so check the bitmap
+      if ((state->partition_err = flash_read(state, sector + sector_end(state) + index / 8, buf, 1)) != ESP_OK)
+         return FLASHLOG_ERR_READERR;
+      used = !(buf[0] >> (index % 8) & 1); }
+   if (*seqno != UINT32_MAX)
+      *seqno = used ? *seqno + index : UINT32_MAX;
+   return FLASHLOG_ERR_OK; }
+
+// read the sequence number in the header of a slot, and with FLASHLOG_OPT_COMMIT, the flags
+static enum flashlog_error
+read_seqno (struct flashlog_state_t *state, int slot, uint32_t *seqno) {
+   struct flashlog_entry_hdr_t hdr;
+   if (state->options & FLASHLOG_OPT_COMPACT)
+      return compact_seqno(state, slot, seqno);
+   int size = state->options & FLASHLOG_OPT_COMMIT ? 8 : FLASHLOG_ENTRY_SEQNO_SIZE;
+   if ((state->partition_err = flash_read(state, slot_offset(state, slot), &hdr, size)) != ESP_OK)
+      return FLASHLOG_ERR_READERR;
+   *seqno = hdr_seqno(state, &hdr);
+   return FLASHLOG_ERR_OK; }
+
+// read the whole header of a slot, through the sector cache if there is one
+static enum flashlog_error
+read_hdr (struct flashlog_state_t *state, int slot, struct flashlog_entry_hdr_t *hdr) {
+   if ((state->partition_err = cached_read(state, slot_offset(state, slot), hdr, state->hdrsize)) != ESP_OK)
+      return FLASHLOG_ERR_READERR;
+   return FLASHLOG_ERR_OK; }
+
+// Set the slot where the next entry will be added, which is after the newest one.
+// For variable-length records that depends on the length of the newest one.
+static enum flashlog_error
+find_next_slot (struct flashlog_state_t *state) {
+   struct flashlog_entry_hdr_t hdr;
+   int next = state->newest + 1;
+   if (state->numinuse == 0)
+      next = state->newest;
+   else if (state->options & FLASHLOG_OPT_VARLEN) {
+      enum flashlog_error err = read_hdr(state, state->newest, &hdr);
+      if (err != FLASHLOG_ERR_OK) return err;
+      next = state->newest + entry_slots(state, hdr.length); }
+   state->nextslot = next >= state->numslots ? 0 : next;
+   return FLASHLOG_ERR_OK; }
+
+// Scan all the entry headers to find the newest and oldest slots and count the slots in use.
+// Instead of doing a tiny read for each slot, we read FLASHLOG_SCANSIZE bytes at a time
+// into the scan buffer and walk the headers there, so the number of flash reads
+// depends on the size of the partition, not on how many entries it holds.
+static enum flashlog_error
+scan_log (struct flashlog_state_t *state, char *scanbuf) {
+   int sectors_per_read = FLASHLOG_SCANSIZE / FLASHLOG_SECTOR;
+   int numsectors = state->numslots / slots_per_sector(state);
+   uint32_t oldest_seqno = UINT32_MAX; // the oldest sequence number is the smallest
+   state->highest_seqno = 0; // the newest sequence number is the largest
+   state->newest = state->oldest = 0; // in case it's empty
+   state->numinuse = 0;
+   for (int sector = 0; sector < numsectors; sector += sectors_per_read) {
+      int nsectors = numsectors - sector;
+      if (nsectors > sectors_per_read) nsectors = sectors_per_read;
+      int offset = FLASHLOG_SLOT0 + sector * FLASHLOG_SECTOR;
+      if ((state->partition_err = flash_read(state, offset, scanbuf, nsectors * FLASHLOG_SECTOR)) != ESP_OK)
+         return FLASHLOG_ERR_READERR;
+      for (int i = 0; i < nsectors; ++i) {
+         const char *sectorbuf = scanbuf + i * FLASHLOG_SECTOR;
+         for (int pos = slot_pos(state, 0); pos < FLASHLOG_SECTOR; pos = sector_next(state, sectorbuf, pos)) {
+            uint32_t seqno = sector_seqno(state, sectorbuf, pos);
+            int slot = (sector + i) * slots_per_sector(state) + pos_slot(state, pos);
+            if (seqno == UINT32_MAX) { // an unused entry
+               if (state->options & FLASHLOG_OPT_VARLEN) break; // records are packed, so the rest are unused too
+               continue; }
+            ++state->numinuse;
+            if (seqno > state->highest_seqno) { // record the higest seqno
+               state->highest_seqno = seqno;
+               state->newest = slot; }
+            if (seqno < oldest_seqno) { // record the oldest slot (lowest seqno)
+               oldest_seqno = seqno;
+               state->oldest = slot; } } } }
+   return FLASHLOG_ERR_OK; }
+
+// Given the sector that holds the newest entry, find the newest and oldest slots.
+// The newest sector is read into the scan buffer so we can find its last entry in RAM,
+// and the oldest entry is at the start of the next sector that isn't erased, or of
+// sector 0 if the log hasn't wrapped around yet. If the result isn't a consistent run
+// of sequence numbers, *found is left false. The sequence number of the first entry
+// in the newest sector is returned in *first_seqno.
+static enum flashlog_error
+finish_search (struct flashlog_state_t *state, int newest_sector, char *scanbuf, bool *found, uint32_t *first_seqno) {
+   int numsectors = state->numslots / slots_per_sector(state);
+   int offset = FLASHLOG_SLOT0 + newest_sector * FLASHLOG_SECTOR;
+   if ((state->partition_err = flash_read(state, offset, scanbuf, FLASHLOG_SECTOR)) != ESP_OK)
+      return FLASHLOG_ERR_READERR;
+   int last = slot_pos(state, 0), count = 1; // entries in a sector are written with consecutive sequence numbers
+   *first_seqno = sector_seqno(state, scanbuf, last);
+   if (*first_seqno == UINT32_MAX)
+      return FLASHLOG_ERR_OK;
+   for (int pos = sector_next(state, scanbuf, last);
+         pos < FLASHLOG_SECTOR && sector_seqno(state, scanbuf, pos) == *first_seqno + count;
+         pos = sector_next(state, scanbuf, pos)) {
+      last = pos;
+      ++count; }
+   state->newest = newest_sector * slots_per_sector(state) + pos_slot(state, last);
+   state->highest_seqno = *first_seqno + count - 1;
+   int oldest_sector = 0;
+   uint32_t oldest_seqno = UINT32_MAX;
+   for (int step = 1; step <= 2; ++step) { // skip at most one erased sector after the newest
+      int sector = (newest_sector + step) % numsectors;
+      uint32_t seqno;
+      if (sector == newest_sector) {
+         oldest_sector = sector;
+         oldest_seqno = *first_seqno;
+         break; }
+      enum flashlog_error err = read_seqno(state, sector * slots_per_sector(state), &seqno);
+      if (err != FLASHLOG_ERR_OK) return err;
+      if (seqno != UINT32_MAX) {
+         oldest_sector = sector;
+         oldest_seqno = seqno;
+         break; } }
+   if (oldest_seqno == UINT32_MAX) { // the log hasn't wrapped around, so the oldest is slot 0
+      enum flashlog_error err = read_seqno(state, 0, &oldest_seqno);
+      if (err != FLASHLOG_ERR_OK) return err;
+      if (oldest_seqno == UINT32_MAX) return FLASHLOG_ERR_OK; }
+   if (oldest_seqno > state->highest_seqno)
+      return FLASHLOG_ERR_OK;
+   state->oldest = oldest_sector * slots_per_sector(state);
+   state->numinuse = state->highest_seqno - oldest_seqno + 1;
+   // the slots from oldest to newest must hold exactly that many entries; we can only
+   // check that if they are all the same size and none were left unfinished
+   *found = (state->options & (FLASHLOG_OPT_VARLEN | FLASHLOG_OPT_COMMIT))
+            || (state->newest - state->oldest + state->numslots) % state->numslots + 1 == state->numinuse;
+   return FLASHLOG_ERR_OK; }
+
+// Find the newest and oldest slots with a binary search instead of reading the whole log.
+// flashlog_add writes slots in increasing sequence number order around the circular log,
+// so the sequence numbers of the first slot of each sector form a sorted sequence
+// that has been rotated, and the newest sector is the rotation point. Only sector 0
+// can be an erased gap in front of the oldest sector. If the log isn't in the state
+// flashlog_add would have left it, *found is false and the caller should scan the log.
+static enum flashlog_error
+search_log (struct flashlog_state_t *state, char *scanbuf, bool *found) {
+   int numsectors = state->numslots / slots_per_sector(state);
+   enum flashlog_error err;
+   uint32_t base_seqno, seqno;
+   *found = false;
+   int base = 0; // the first sector of the sorted run
+   if ((err = read_seqno(state, 0, &base_seqno)) != FLASHLOG_ERR_OK) return err;
+   if (base_seqno == UINT32_MAX && numsectors > 1) {
+      base = 1;
+      if ((err = read_seqno(state, slots_per_sector(state), &base_seqno)) != FLASHLOG_ERR_OK) return err; }
+   if (base_seqno == UINT32_MAX) { // the log is empty
+      state->highest_seqno = 0;
+      state->newest = state->oldest = 0;
+      state->numinuse = 0;
+      *found = true;
+      return FLASHLOG_ERR_OK; }
+   // find the last sector whose first entry is in use and not older than the base sector's
+   int lo = base, hi = numsectors - 1;
+   while (lo < hi) {
+      int mid = (lo + hi + 1) / 2;
+      if ((err = read_seqno(state, mid * slots_per_sector(state), &seqno)) != FLASHLOG_ERR_OK) return err;
+      if (seqno != UINT32_MAX && seqno >= base_seqno) lo = mid;
+      else hi = mid - 1; }
+   return finish_search(state, lo, scanbuf, found, &seqno); }
+
+// The copy of the state for FLASHLOG_OPT_RTC, which lives in RTC slow memory that is not
+// initialized at startup. The check word tells whether it is valid.
+struct flashlog_rtc_t {
+   uint32_t address, size;   // identifies the partition
+   int datasize, numslots, options;
+   uint32_t highest_seqno;
+   int numinuse, newest, oldest, nexthint;
+   uint32_t check; };         // a checksum of the above
+static RTC_NOINIT_ATTR struct flashlog_rtc_t rtc_state[FLASHLOG_RTC_LOGS];
+
+static uint32_t
+rtc_checksum (struct flashlog_rtc_t *rtc) {
+   uint32_t sum = 0x464c4f47; // nonzero, so zeroed memory doesn't look valid
+   for (uint32_t *p = (uint32_t *)rtc; p < &rtc->check; ++p)
+      sum = ((sum << 5) | (sum >> 27)) ^ *p;
+   return sum; }
+
+// find the RTC copy of the state for the log's partition, or a place to put it
+static struct flashlog_rtc_t *
+rtc_find (struct flashlog_state_t *state) {
+   struct flashlog_rtc_t *unused = NULL;
+   for (int i = 0; i < FLASHLOG_RTC_LOGS; ++i) {
+      struct flashlog_rtc_t *rtc = &rtc_state[i];
+      bool valid = rtc->check == rtc_checksum(rtc);
+      if (valid && rtc->address == state->partition->address && rtc->size == state->partition->size)
+         return rtc;
+      if (!valid && !unused)
+         unused = rtc; }
+   return unused ? unused : &rtc_state[state->partition->address / FLASHLOG_SECTOR % FLASHLOG_RTC_LOGS]; }
+
+// save the state of the log in RTC memory, if that option is on
+static void
+rtc_save (struct flashlog_state_t *state) {
+   if (!(state->options & FLASHLOG_OPT_RTC))
+      return;
+   struct flashlog_rtc_t *rtc = rtc_find(state);
+   rtc->address = state->partition->address;
+   rtc->size = state->partition->size;
+   rtc->datasize = state->datasize;
+   rtc->numslots = state->numslots;
+   rtc->options = state->options & FLASHLOG_OPT_FORMAT;
+   rtc->highest_seqno = state->highest_seqno;
+   rtc->numinuse = state->numinuse;
+   rtc->newest = state->newest;
+   rtc->oldest = state->oldest;
+   rtc->nexthint = state->nexthint;
+   rtc->check = rtc_checksum(rtc); }
+
+// Try to restore the state of the log from RTC memory. We check that the log header is
+// still there, that the newest slot has the highest sequence number, and that the slot
+// after it is either unused or is the oldest entry. Then *found is true.
+static enum flashlog_error
+rtc_restore (struct flashlog_state_t *state, bool *found) {
+   struct flashlog_rtc_t *rtc = rtc_find(state);
+   struct flashlog_hdr_t hdr;
+   uint32_t seqno;
+   enum flashlog_error err;
+   *found = false;
+   if (rtc->check != rtc_checksum(rtc) || rtc->address != state->partition->address
+         || rtc->size != state->partition->size || rtc->datasize != state->datasize
+         || rtc->options != (state->options & FLASHLOG_OPT_FORMAT))
+      return FLASHLOG_ERR_OK;
+   if ((state->partition_err = flash_read(state, 0, &hdr, sizeof(hdr))) != ESP_OK)
+      return FLASHLOG_ERR_READERR;
+   if (memcmp(hdr.id, FLASHLOG_ID, sizeof(hdr.id)) != 0 || hdr.datasize != rtc->datasize
+         || hdr.numslots != rtc->numslots || rtc->newest < 0 || rtc->newest >= rtc->numslots)
+      return FLASHLOG_ERR_OK;
+   state->numslots = rtc->numslots;
+   state->highest_seqno = rtc->highest_seqno;
+   state->numinuse = rtc->numinuse;
+   state->newest = rtc->newest;
+   state->oldest = rtc->oldest;
+   if ((err = read_seqno(state, rtc->newest, &seqno)) != FLASHLOG_ERR_OK)
+      return err;
+   if (rtc->numinuse == 0 ? seqno != UINT32_MAX : seqno != rtc->highest_seqno)
+      return FLASHLOG_ERR_OK;
+   if (rtc->numinuse > 0) {
+      // nothing may have been added after the newest, either right after it
+      // or, for variable-length records, at the start of the next sector
+      if ((err = find_next_slot(state)) != FLASHLOG_ERR_OK)
+         return err;
+      int next = state->nextslot;
+      for (int check = 0; check < 2; ++check) {
+         // if a header doesn't fit before the end of the sector, nothing can start
+         // there, and reading one could go past the end of the partition
+         if (next % slots_per_sector(state) + entry_slots(state, 0) <= slots_per_sector(state)) {
+            if ((err = read_seqno(state, next, &seqno)) != FLASHLOG_ERR_OK)
+               return err;
+            if (seqno != UINT32_MAX && seqno != rtc->highest_seqno - rtc->numinuse + 1)
+               return FLASHLOG_ERR_OK; }
+         if (!(state->options & FLASHLOG_OPT_VARLEN) || next % slots_per_sector(state) == 0)
+            break;
+         next = (next / slots_per_sector(state) + 1) * slots_per_sector(state);
+         if (next >= state->numslots) next = 0; } }
+   state->nexthint = rtc->nexthint;
+   *found = true;
+   return FLASHLOG_ERR_OK; }
+
+// Erase the sector that holds the oldest entries, and adjust for the entries thus deleted.
+// For variable-length records, or if an unfinished entry may have left a gap, we don't
+// know how many there were, so we look at the first entry of the next sector, which
+// becomes the oldest.
+static enum flashlog_error
+erase_oldest_sector (struct flashlog_state_t *state) {
+   enum flashlog_error err;
+   int sector = state->oldest / slots_per_sector(state);
+   int numsectors = state->numslots / slots_per_sector(state);
+#ifdef FLASHLOG_STATS
+   uint32_t start = cycle_count();
+#endif
+   if ((state->partition_err = flash_erase(state, FLASHLOG_SLOT0 + sector * FLASHLOG_SECTOR,
+                               FLASHLOG_SECTOR)) != ESP_OK)
+      return FLASHLOG_ERR_ERASEERR;
+#ifdef FLASHLOG_STATS
+   histogram_add(state->stats.erase_cycles, cycle_count() - start);
+#endif
+   state->oldest = (sector + 1) % numsectors * slots_per_sector(state);
+   if (!(state->options & (FLASHLOG_OPT_VARLEN | FLASHLOG_OPT_COMMIT)))
+      state->numinuse -= slots_per_sector(state);
+   else {
+      uint32_t seqno = UINT32_MAX;
+      if (numsectors > 1
+            && (err = read_seqno(state, state->oldest, &seqno)) != FLASHLOG_ERR_OK)
+         return err;
+      state->numinuse = seqno == UINT32_MAX ? 0 : state->highest_seqno - seqno + 1; }
+   if (state->numinuse <= 0) { // the log is now empty
+      state->numinuse = 0;
+      state->oldest = state->newest = state->nextslot; }
+   rtc_save(state); // the copy must not say the erased entries are still there
+   return FLASHLOG_ERR_OK; }
+
+// With FLASHLOG_OPT_PREERASE, note whether the sector after the one with the newest entry
+// still has entries in it, which flashlog_maintain or the next add should erase.
+static void
+check_preerase (struct flashlog_state_t *state) {
+   int numsectors = state->numslots / slots_per_sector(state);
+   state->erase_pending = (state->options & FLASHLOG_OPT_PREERASE) && state->numinuse > 0
+                          && numsectors > 1
+                          && state->oldest / slots_per_sector(state) == (state->newest / slots_per_sector(state) + 1) % numsectors; }
+
+// Sector summaries, for FLASHLOG_OPT_SUMMARY. state->summary describes the entries in the
+// sector that is being filled, and is written at the end of that sector when an entry
+// is added at the start of the next one.
+
+static uint32_t
+summary_check (const struct flashlog_summary_t *summary) {
+   return ~(summary->first_seqno + summary->last_seqno + summary->min_time + summary->max_time + summary->types); }
+
+// the bit in a summary's "types" for an entry
+static uint32_t
+entry_type_bit (struct flashlog_state_t *state, const struct flashlog_entry_hdr_t *entry) {
+   if (state->hdrsize > FLASHLOG_ENTRY_SEQNO_SIZE && entry->length == 0)
+      return 1;
+   return (uint32_t)1 << (*((const uint8_t *)entry + state->hdrsize) % 32); }
+
+static void
+summary_add (struct flashlog_state_t *state, const struct flashlog_entry_hdr_t *entry) {
+   struct flashlog_summary_t *summary = &state->summary;
+   uint32_t t = state->options & FLASHLOG_OPT_TIMESTAMP ? entry->timestamp : 0;
+   if (summary->first_seqno == UINT32_MAX) {
+      summary->first_seqno = entry->seqno;
+      summary->min_time = t;
+      summary->types = 0; }
+   summary->last_seqno = entry->seqno;
+   summary->max_time = t;
+   summary->types |= entry_type_bit(state, entry); }
+
+// write the summary of the sector with the newest entry, if it has any entries
+static enum flashlog_error
+write_summary (struct flashlog_state_t *state) {
+   struct flashlog_summary_t *summary = &state->summary;
+   if (summary->first_seqno == UINT32_MAX)
+      return FLASHLOG_ERR_OK;
+   summary->check = summary_check(summary);
+   int sector = state->newest / slots_per_sector(state);
+   esp_err_t err = flash_write(state, FLASHLOG_SLOT0 + (sector + 1) * FLASHLOG_SECTOR - FLASHLOG_SUMMARY_SIZE,
+                               summary, sizeof(*summary));
+   memset(summary, 0xff, sizeof(*summary));
+   if ((state->partition_err = err) != ESP_OK)
+      return FLASHLOG_ERR_WRITEERR;
+   return FLASHLOG_ERR_OK; }
+
+// Rebuild state->summary from the entries in the sector with the newest entry. If that
+// sector's summary has already been written, which happens if the power failed before the
+// entry that started the next sector was finished, the sector is closed: nothing more can
+// go in it, because that would need a different summary, so the next entry starts the next
+// sector, and there is no summary to write then.
+static enum flashlog_error
+rebuild_summary (struct flashlog_state_t *state, char *buf) {
+   memset(&state->summary, 0xff, sizeof(state->summary));
+   if (state->numinuse == 0)
+      return FLASHLOG_ERR_OK;
+   int sector = state->newest / slots_per_sector(state);
+   if ((state->partition_err = flash_read(state, FLASHLOG_SLOT0 + sector * FLASHLOG_SECTOR, buf, FLASHLOG_SECTOR)) != ESP_OK)
+      return FLASHLOG_ERR_READERR;
+   if (!all_erased(buf + FLASHLOG_SECTOR - FLASHLOG_SUMMARY_SIZE, FLASHLOG_SUMMARY_SIZE)) {
+      if (state->nextslot / slots_per_sector(state) == sector && state->nextslot % slots_per_sector(state) != 0)
+         state->nextslot = (sector + 1) * slots_per_sector(state) % state->numslots;
+      return FLASHLOG_ERR_OK; }
+   int newest = state->newest % slots_per_sector(state) * state->slotsize;
+   for (int pos = 0; pos <= newest && sector_seqno(state, buf, pos) != UINT32_MAX; pos = sector_next(state, buf, pos))
+      summary_add(state, (const struct flashlog_entry_hdr_t *)(buf + pos));
+   return FLASHLOG_ERR_OK; }
+
+// the log header for the state's partition, datasize, and options
+static void
+make_header (struct flashlog_state_t *state, struct flashlog_hdr_t *hdr) {
+   memcpy(hdr->id, FLASHLOG_ID, sizeof(hdr->id));
+   hdr->datasize = state->datasize;
+   hdr->numslots = state->numslots;
+   hdr->options = state->options & FLASHLOG_OPT_FORMAT; }
+
+// Write the log header at the start of the header sector, which must be erased. The ID
+// goes last, so that if the power fails before it's done, the header is "torn" (see below).
+static enum flashlog_error
+write_header (struct flashlog_state_t *state) {
+   struct flashlog_hdr_t hdr;
+   make_header(state, &hdr);
+   int id = sizeof(hdr.id);
+   if ((state->partition_err = flash_write(state, id, (char *)&hdr + id, sizeof(hdr) - id)) != ESP_OK
+         || (state->partition_err = flash_write(state, 0, &hdr, id)) != ESP_OK)
+      return FLASHLOG_ERR_WRITEERR;
+   return FLASHLOG_ERR_OK; }
+
+// Check whether the header sector read into "sector" is one whose header was being written
+// for this log when the power failed: the ID isn't all there, but every byte of the header
+// has at least the 1-bits it should, and nothing after it has been written. That happens
+// when the hint area is started over, and the entries in the log are still good.
+static bool
+header_torn (struct flashlog_state_t *state, const char *sector) {
+   struct flashlog_hdr_t hdr;
+   make_header(state, &hdr);
+   if (memcmp(sector, hdr.id, sizeof(hdr.id)) == 0)
+      return false;
+   const uint8_t *want = (const uint8_t *)&hdr, *have = (const uint8_t *)sector;
+   for (int i = 0; i < (int)sizeof(hdr); ++i)
+      if ((have[i] & want[i]) != want[i])
+         return false;
+   return all_erased(sector + sizeof(hdr), FLASHLOG_SECTOR - sizeof(hdr)); }
+
+// Append an open hint to the header sector, recording the slot and sequence number of an
+// entry that starts a new sector. When the hint area is full, which takes hundreds of
+// sectors, the header sector is erased and the header rewritten to start it over. If the
+// power fails before the header is finished, flashlog_open finds it torn and the log
+// intact, and the next hint written does the erase and rewrite again.
+// A failed hint write is not reported, because it only makes the next flashlog_open slower.
+static void
+write_hint (struct flashlog_state_t *state, int slot, uint32_t seqno) {
+   struct flashlog_hint_t hint;
+   if (state->nexthint >= FLASHLOG_NUMHINTS) { // the hint area is full, so start it over
+      if ((state->partition_err = flash_erase(state, 0, FLASHLOG_SECTOR)) != ESP_OK
+            || write_header(state) != FLASHLOG_ERR_OK)
+         return;
+      state->nexthint = 0; }
+   hint.newest = slot;
+   hint.seqno = seqno;
+   int offset = FLASHLOG_HINT0 + state->nexthint * sizeof(struct flashlog_hint_t);
+   ++state->nexthint;
+   state->partition_err = flash_write(state, offset, &hint, sizeof(hint)); }
+
+// Try to find the newest and oldest slots starting from the last open hint, which names the
+// first slot of the sector that held the newest entry when the hint was written. If entries
+// have since been added past the end of that sector without a new hint, or the hint
+// doesn't match the log, *found is false.
+static enum flashlog_error
+use_hint (struct flashlog_state_t *state, struct flashlog_hint_t hint, char *scanbuf, bool *found) {
+   uint32_t first_seqno;
+   *found = false;
+   if (hint.newest < 0 || hint.newest >= state->numslots || hint.newest % slots_per_sector(state) != 0)
+      return FLASHLOG_ERR_OK;
+   enum flashlog_error err = finish_search(state, hint.newest / slots_per_sector(state), scanbuf, found, &first_seqno);
+   if (err == FLASHLOG_ERR_OK && *found) // check that the sector still starts with the hinted entry
+      *found = first_seqno == hint.seqno;
+   return err; }
+
+// With FLASHLOG_OPT_COMMIT, check that there is room for an entry at "slot", read into the
+// entry buffer, which is all erased unless the power failed while an entry was being written.
+static enum flashlog_error
+slot_erased (struct flashlog_state_t *state, int slot, bool *erased) {
+   int length = state->hdrsize + state->datasize;
+   int room = sector_end(state) - slot % slots_per_sector(state) * state->slotsize;
+   if (length > room) length = room;
+   if ((state->partition_err = flash_read(state, slot_offset(state, slot), state->entrybuf, length)) != ESP_OK)
+      return FLASHLOG_ERR_READERR;
+   *erased = true;
+   for (int i = 0; i < length; ++i)
+      if (((const uint8_t *)state->entrybuf)[i] != 0xff)
+         *erased = false;
+   return FLASHLOG_ERR_OK; }
+
+// With FLASHLOG_OPT_COMMIT, an entry that wasn't finished because the power failed is
+// ignored by flashlog_open, but its slot can't be written again until it's erased. If it's
+// where the next entry would go, that goes at the start of the next sector instead. If
+// it's at the start of a sector, which happens if it didn't fit after the newest entry,
+// that sector is erased before it is used.
+static enum flashlog_error
+check_next_slot (struct flashlog_state_t *state) {
+   int numsectors = state->numslots / slots_per_sector(state);
+   bool erased;
+   enum flashlog_error err;
+   if (state->nextslot % slots_per_sector(state) != 0) {
+      if ((err = slot_erased(state, state->nextslot, &erased)) != FLASHLOG_ERR_OK)
+         return err;
+      if (!erased)
+         state->nextslot = (state->nextslot / slots_per_sector(state) + 1) % numsectors * slots_per_sector(state); }
+   // the sector the next entry goes in, or the one after it if this one fills up
+   int sector = state->nextslot % slots_per_sector(state) == 0 ? state->nextslot / slots_per_sector(state)
+                : (state->nextslot / slots_per_sector(state) + 1) % numsectors;
+   if (state->numinuse > 0 && (sector == state->oldest / slots_per_sector(state) || sector == state->newest / slots_per_sector(state)))
+      return FLASHLOG_ERR_OK; // it has entries and will be erased before it's used, or it's where they go
+   if ((err = slot_erased(state, sector * slots_per_sector(state), &erased)) != FLASHLOG_ERR_OK)
+      return err;
+   if (!erased)
+      state->torn_sector = sector;
+   return FLASHLOG_ERR_OK; }
+
+// open an existing log, or initialize a new one, using the scan buffer
+static enum flashlog_error
+open_log (struct flashlog_state_t *state, char *scanbuf) {
+   const esp_partition_t *partition = state->partition;
+   struct flashlog_hdr_t hdr;
+   enum flashlog_error err;
+   // read the header sector, which has the log header followed by the open hints
+   if ((state->partition_err = flash_read(state, 0, scanbuf, FLASHLOG_SECTOR)) != ESP_OK)
+      return FLASHLOG_ERR_READERR;
+   memcpy(&hdr, scanbuf, sizeof(hdr));
+   if (hdr.options == -1) hdr.options = 0; // logs written before there were options
+   if (memcmp(hdr.id, FLASHLOG_ID, sizeof(hdr.id)) != 0 // if no header (an uninitialized partition)
+   || hdr.datasize != state->datasize // or the log entry data size is different,
+   || hdr.options != (state->options & FLASHLOG_OPT_FORMAT)) { // or the format is different,
+      state->numslots = (partition->size - FLASHLOG_SLOT0) / FLASHLOG_SECTOR * slots_per_sector(state);
+      if (header_torn(state, scanbuf)) {
+         // the power failed while the hint area was being started over, so use the log
+         // as it is, and have the next hint written erase the header sector again
+         bool found;
+         if ((err = search_log(state, scanbuf, &found)) != FLASHLOG_ERR_OK)
+            return err;
+         if (found && state->numinuse > 0) { // an empty one might as well be initialized
+            state->nexthint = FLASHLOG_NUMHINTS;
+            return FLASHLOG_ERR_OK; } }
+      // initialize the log from scratch, starting with a complete erase of the partition;
+      // the header sector goes last, so that an erased one with entries after it was torn
+      if ((state->partition_err = flash_erase(state, FLASHLOG_SLOT0, partition->size - FLASHLOG_SLOT0)) != ESP_OK
+            || (state->partition_err = flash_erase(state, 0, FLASHLOG_SECTOR)) != ESP_OK)
+         return FLASHLOG_ERR_ERASEERR;
+      // initialize the ram-resident state information and write the log header
+      state->highest_seqno = 0;
+      state->oldest = state->newest = state->current = 0;
+      state->numinuse = 0;
+      state->nexthint = 0;
+      return write_header(state); }
+   // the log exists
+   state->numslots = hdr.numslots;
+   // find the last open hint, which is followed by an erased one
+   struct flashlog_hint_t *hints = (struct flashlog_hint_t *)(scanbuf + FLASHLOG_HINT0);
+   int nexthint = 0;
+   while (nexthint < FLASHLOG_NUMHINTS
+          && (hints[nexthint].newest != -1 || hints[nexthint].seqno != UINT32_MAX))
+      ++nexthint;
+   state->nexthint = nexthint;
+   // find the slots in use, first from the last hint, then with a quick binary search,
+   // and then if the log doesn't look the way flashlog_add leaves it, by reading all the entry headers
+   bool found = false;
+   if (nexthint > 0
+         && (err = use_hint(state, hints[nexthint - 1], scanbuf, &found)) != FLASHLOG_ERR_OK)
+      return err;
+   if (!found
+         && (err = search_log(state, scanbuf, &found)) != FLASHLOG_ERR_OK)
+      return err;
+   if (!found)
+      return scan_log(state, scanbuf);
+   return FLASHLOG_ERR_OK; }
 
 // open or create the log partition with as many entries of the specified size as will fit
 enum flashlog_error
@@ -37,133 +970,1200 @@ flashlog_open (
    const char *logname, // the optional partition name, or if null use the first log-type partition
    int datasize, // the size of user data in each log entry
    struct flashlog_state_t *state) { // where to put the ram-resident state structure
+   return flashlog_open_options(logname, datasize, 0, state); }
+
+// open or create the log partition, with options
+enum flashlog_error
+flashlog_open_options (
+   const char *logname, // the optional partition name, or if null use the first log-type partition
+   int datasize, // the size of user data in each log entry, or the maximum size for variable-length records
+   int options, // FLASHLOG_OPT_xxx options
+   struct flashlog_state_t *state) { // where to put the ram-resident state structure
+   return flashlog_open_buffer(logname, datasize, options, state, NULL); }
+
+// open or create the log partition, with options and maybe a buffer for log entries
+enum flashlog_error
+flashlog_open_buffer (
+   const char *logname, // the optional partition name, or if null use the first log-type partition
+   int datasize, // the size of user data in each log entry, or the maximum size for variable-length records
+   int options, // FLASHLOG_OPT_xxx options
+   struct flashlog_state_t *state, // where to put the ram-resident state structure
+   void *entrybuf) { // a buffer for a log entry with its header, or NULL to allocate one
 
    const esp_partition_t *partition;
-   struct flashlog_hdr_t hdr;
+   char *scanbuf;
 
    if (!(partition = esp_partition_find_first(ESP_PARTITION_TYPE_LOG, ESP_PARTITION_SUBTYPE_ANY, logname)))
       return FLASHLOG_ERR_NO_PARTITION;
    state->partition = partition; // remember the partition we are to use
-   // check that the datasize plus the header is a power of two, up to 4096
-   int entrysize = datasize + sizeof(struct flashlog_entry_hdr_t);
-   if (entrysize > 4096 || (entrysize & (entrysize - 1)) != 0)
-      return FLASHLOG_ERR_BADSIZE;
+   state->hdrsize = FLASHLOG_HDRSIZE(options);
+   int entrysize = datasize + state->hdrsize;
+   if ((options & FLASHLOG_OPT_COMPACT)
+         && (state->hdrsize > FLASHLOG_ENTRY_SEQNO_SIZE || (options & FLASHLOG_OPT_SUMMARY)))
+      return FLASHLOG_ERR_NOTSUPP; // those need entry headers
+   if ((options & FLASHLOG_OPT_COMPRESS) && (options & FLASHLOG_OPT_SUMMARY))
+      return FLASHLOG_ERR_NOTSUPP; // the entry types would be compressed bytes
+   if (options & FLASHLOG_OPT_COMPACT) {
+      // the slots are just the data, which must keep them on 4-byte boundaries
+      if (datasize <= 0 || datasize % 4 != 0 || datasize + 2 * FLASHLOG_ENTRY_SEQNO_SIZE > FLASHLOG_SECTOR)
+         return FLASHLOG_ERR_BADSIZE;
+      state->slotsize = datasize; }
+   else if (options & FLASHLOG_OPT_VARLEN) {
+      // check that a record of the maximum size fits in a sector
+      if (datasize <= 0 || entrysize > FLASHLOG_SECTOR)
+         return FLASHLOG_ERR_BADSIZE;
+      state->slotsize = FLASHLOG_VARLEN_UNIT; }
+   else {
+      // check that the datasize plus the header is a power of two, up to 4096
+      if (entrysize > 4096 || (entrysize & (entrysize - 1)) != 0)
+         return FLASHLOG_ERR_BADSIZE;
+      state->slotsize = entrysize; }
    state->datasize = datasize;
-   // read the header that should be at the start of the log
-   if ((state->partition_err = esp_partition_read(partition, 0, &hdr, sizeof(hdr))) != ESP_OK)
-      return FLASHLOG_ERR_READERR;
-   if (memcmp(hdr.id, FLASHLOG_ID, sizeof(hdr.id)) != 0 // if no header (an uninitialized partition)
-   || hdr.datasize != datasize) { // or the log entry data size is different,
-      // initialize the log from scratch, starting with a complete erase of the partition
-      if ((state->partition_err = esp_partition_erase_range(partition, 0, partition->size)) != ESP_OK)
-         return FLASHLOG_ERR_ERASEERR;
-      memcpy(hdr.id, FLASHLOG_ID, sizeof(hdr.id));  // initialize and write the log header
-      hdr.datasize = datasize;
-      hdr.numslots = (partition->size - FLASHLOG_SLOT0) / (datasize + sizeof(struct flashlog_entry_hdr_t));
-      if ((state->partition_err = esp_partition_write(partition, 0, &hdr, sizeof(hdr))) != ESP_OK)
-         return FLASHLOG_ERR_WRITEERR;
-      // initialize the ram-resident state information
-      state->numslots = hdr.numslots;
-      state->highest_seqno = 0;
-      state->oldest = state->newest = state->current = 0;
-      state->numinuse = 0; }
-   else { // the log exists
-      state->numslots = hdr.numslots;
-      // read all the entry headers to find out about slots in use
-      uint32_t oldest_seqno = UINT32_MAX; // the oldest sequence number is the smallest
-      state->highest_seqno = 0; // the newest sequence number is the largest
-      state->newest = state->oldest = 0; // in case it's empty
-      for (int slot = 0; slot < hdr.numslots; ++slot) {
-         struct flashlog_entry_hdr_t entryhdr;
-         int offset = FLASHLOG_SLOT0 + slot * (hdr.datasize + sizeof(struct flashlog_entry_hdr_t));
-         if ((state->partition_err = esp_partition_read(partition, offset, &entryhdr, sizeof(entryhdr))) != ESP_OK)
-            return FLASHLOG_ERR_READERR;
-         if (entryhdr.seqno != UINT32_MAX) {  // not an unused entry
-            ++state->numinuse;
-            if (entryhdr.seqno > state->highest_seqno) { // record the higest seqno
-               state->highest_seqno = entryhdr.seqno;
-               state->newest = slot; }
-            if (entryhdr.seqno < oldest_seqno) { // record the oldest slot (lowest seqno)
-               oldest_seqno = entryhdr.seqno;
-               state->oldest = slot; } } }  }
+   state->options = options;
+   if (slots_per_sector(state) == 0 // no room for a sector summary
+         || entry_slots(state, datasize) > slots_per_sector(state)) // or for a full-size record before it
+      return FLASHLOG_ERR_BADSIZE;
+   state->async = NULL;
+   state->lz = NULL;
+   state->sectorbuf = NULL;
+   state->entrybuf_given = entrybuf != NULL;
+   state->mapped = NULL;
+   state->cached_sector = -1;
+   state->torn_sector = -1;
+#ifdef FLASHLOG_STATS
+   memset(&state->stats, 0, sizeof(state->stats));
+#endif
+   bool found = false;
+   enum flashlog_error err;
+   if ((options & FLASHLOG_OPT_RTC)
+         && (err = rtc_restore(state, &found)) != FLASHLOG_ERR_OK)
+      return err;
+   if (!found) {
+      // allocate a temporary buffer for reading the log a sector at a time
+      if (!(scanbuf = (char *)malloc(FLASHLOG_SCANSIZE)))
+         return FLASHLOG_ERR_NOMEM;
+      err = open_log(state, scanbuf);
+      free(scanbuf);
+      if (err != FLASHLOG_ERR_OK
+            || (err = find_next_slot(state)) != FLASHLOG_ERR_OK)
+         return err;
+      rtc_save(state); }
+   if (options & FLASHLOG_OPT_SUMMARY) {
+      if (!(scanbuf = (char *)malloc(FLASHLOG_SECTOR)))
+         return FLASHLOG_ERR_NOMEM;
+      err = rebuild_summary(state, scanbuf);
+      free(scanbuf);
+      if (err != FLASHLOG_ERR_OK)
+         return err; }
    state->current = state->newest;
-   // allocate a buffer for an log entry with its header
-   if (!(state->entrybuf = (struct flashlog_entry_hdr_t *)malloc(datasize + sizeof(struct flashlog_entry_hdr_t))))
+   state->newest_time = 0;
+   if ((options & FLASHLOG_OPT_TIMESTAMP) && state->numinuse > 0) {
+      struct flashlog_entry_hdr_t hdr; // new entries can't be older than the newest one
+      if ((err = read_hdr(state, state->newest, &hdr)) != FLASHLOG_ERR_OK)
+         return err;
+      state->newest_time = hdr.timestamp; }
+   check_preerase(state);
+   // for variable-length records, the sector cache, queries, or finding entries around gaps,
+   // allocate a buffer for a sector
+   if ((options & (FLASHLOG_OPT_VARLEN | FLASHLOG_OPT_CACHE | FLASHLOG_OPT_SUMMARY | FLASHLOG_OPT_COMMIT))
+         && !(state->sectorbuf = (char *)malloc(FLASHLOG_SECTOR)))
       return FLASHLOG_ERR_NOMEM;
-   state->logdata = (char *)state->entrybuf + sizeof(struct flashlog_entry_hdr_t); // where the user data part goes
+   // use the caller's buffer for a log entry with its header, or allocate one
+   if (!(state->entrybuf = (struct flashlog_entry_hdr_t *)(entrybuf ? entrybuf : malloc(entrysize)))) {
+      free(state->sectorbuf);
+      state->sectorbuf = NULL;
+      return FLASHLOG_ERR_NOMEM; }
+   // for compressed entries, allocate the compressor's tables and a buffer for an entry
+   if ((options & FLASHLOG_OPT_COMPRESS)
+         && !(state->lz = (struct flashlog_lz_t *)malloc(sizeof(struct flashlog_lz_t) + entrysize))) {
+      if (!entrybuf) free(state->entrybuf);
+      free(state->sectorbuf);
+      state->entrybuf = NULL;
+      state->sectorbuf = NULL;
+      return FLASHLOG_ERR_NOMEM; }
+   if (state->lz) {
+      state->lz->dict = NULL;
+      state->lz->dictlen = 0;
+      state->lz->entry = (struct flashlog_entry_hdr_t *)(state->lz + 1); }
+   state->logdata = (char *)state->entrybuf + state->hdrsize; // where the user data part goes
+   if (state->hdrsize > FLASHLOG_ENTRY_SEQNO_SIZE)
+      state->entrybuf->flags = 0xffff; // leave the reserved bits erased
+   state->datalen = 0;
+   if (options & FLASHLOG_OPT_MMAP) {
+      // map the partition into the data address space; if there isn't room, just do without
+      const void *mapped;
+      esp_partition_mmap_handle_t handle;
+      if (esp_partition_mmap(partition, 0, partition->size, ESP_PARTITION_MMAP_DATA, &mapped, &handle) == ESP_OK) {
+         state->mapped = (const char *)mapped;
+         state->map_handle = handle; } }
+   if ((options & FLASHLOG_OPT_CRC) && state->numinuse > 0
+         && flashlog_read(state) == FLASHLOG_ERR_CRC // check the newest entry
+         && (options & FLASHLOG_OPT_VARLEN) && state->nextslot % slots_per_sector(state) != 0) {
+      // It was damaged, maybe by losing power while it was being written, so its length
+      // can't be trusted to say where the next entry goes. Put that in the next sector.
+      state->nextslot = (state->nextslot / slots_per_sector(state) + 1) * slots_per_sector(state);
+      if (state->nextslot >= state->numslots) state->nextslot = 0; }
+   state->datalen = 0;
+   if (options & FLASHLOG_OPT_COMMIT)
+      return check_next_slot(state);
    return FLASHLOG_ERR_OK; }
 
-// close the log and free the buffer we allocated
+// close the log and free the buffers we allocated
 enum flashlog_error
 flashlog_close (struct flashlog_state_t *state) {
-   if (state->entrybuf)
+   flashlog_async_stop(state);
+   if (state->mapped)
+      flashlog_munmap(state->map_handle);
+   state->mapped = NULL;
+   if (state->entrybuf && !state->entrybuf_given)
       free((void *)state->entrybuf);
+   if (state->sectorbuf)
+      free(state->sectorbuf);
+   free(state->lz);
    state->entrybuf = NULL;
+   state->sectorbuf = NULL;
+   state->lz = NULL;
+   state->cached_sector = -1;
    state->logdata = NULL;
    return FLASHLOG_ERR_OK; }
 
+// The slot where an entry that takes "nslots" slots will be added: the next slot,
+// unless there isn't room for it in that sector, in which case it's the next sector.
+static int
+fit_slot (struct flashlog_state_t *state, int nslots) {
+   int slot = state->nextslot;
+   if (slot % slots_per_sector(state) + nslots > slots_per_sector(state)) {
+      slot += slots_per_sector(state) - slot % slots_per_sector(state);
+      if (slot >= state->numslots) slot = 0; }
+   return slot; }
+
+// With FLASHLOG_OPT_COMPACT, write the data of "count" entries into the slots starting at
+// "slot". If they start a sector, the first entry's header is written too, because it's
+// the sector's first sequence number. Entries that are all 0xff are marked in the bitmap.
+static enum flashlog_error
+write_compact (struct flashlog_state_t *state, int slot, char *entries, int count) {
+   int skip = slot % slots_per_sector(state) == 0 ? 0 : FLASHLOG_ENTRY_SEQNO_SIZE;
+   if ((state->partition_err = flash_write(state, slot_offset(state, slot) - FLASHLOG_ENTRY_SEQNO_SIZE + skip,
+                                           entries + skip, count * state->slotsize + state->hdrsize - skip)) != ESP_OK)
+      return FLASHLOG_ERR_WRITEERR;
+   int sector = FLASHLOG_SLOT0 + slot / slots_per_sector(state) * FLASHLOG_SECTOR;
+   for (int i = 0; i < count; ++i)
+      if (all_erased(entries + state->hdrsize + i * state->slotsize, state->slotsize)) {
+         int index = (slot + i) % slots_per_sector(state);
+         int offset = sector + sector_end(state) + index / 8;
+         uint8_t bits; // keep the bits of other slots as they are
+         if ((state->partition_err = flash_read(state, offset, &bits, 1)) != ESP_OK)
+            return FLASHLOG_ERR_READERR;
+         bits &= ~(1 << (index % 8));
+         if ((state->partition_err = flash_write(state, offset, &bits, 1)) != ESP_OK)
+            return FLASHLOG_ERR_WRITEERR; }
+   return FLASHLOG_ERR_OK; }
+
+// Write "count" new log entries from a buffer with room for their headers into the slots
+// after the newest one. They must all fit in the sector that the first one goes into.
+// The entries are consecutive in the buffer, each taking up as many slots as it uses
+// in the log; for variable-length records the buffer has their lengths in the headers.
+// With FLASHLOG_OPT_COMPACT only the first entry has a header, and the data of all of
+// them follows it.
+static enum flashlog_error
+write_entries (struct flashlog_state_t *state, char *entries, int count) {
+   enum flashlog_error err;
+   int length = 0, pos = 0; // how many bytes to write, and where the last entry is
+   for (int i = 0; i < count; ++i) { // assign new sequence numbers
+      struct flashlog_entry_hdr_t *entry = (struct flashlog_entry_hdr_t *)(entries + length);
+      if (i == 0 || !(state->options & FLASHLOG_OPT_COMPACT)) // compact entries have only the first header
+         entry->seqno = state->highest_seqno + 1 + i;
+      if (state->options & FLASHLOG_OPT_TIMESTAMP) { // keep the timestamps in order
+         if (entry->timestamp < state->newest_time) entry->timestamp = state->newest_time;
+         state->newest_time = entry->timestamp; }
+      if (state->options & FLASHLOG_OPT_CRC) {
+         if (!(state->options & FLASHLOG_OPT_TIMESTAMP))
+            entry->timestamp = UINT32_MAX; // unused, so leave it erased
+         entry->crc = entry_crc(state, entry); }
+      pos = length;
+      length += entry_slots(state, entry->length) * state->slotsize; }
+   int slot = fit_slot(state, length / state->slotsize);
+   if (slot % slots_per_sector(state) == 0 && (state->options & FLASHLOG_OPT_SUMMARY)
+         && (err = write_summary(state)) != FLASHLOG_ERR_OK) // the sector with the newest entry is done
+      return err;
+   if (slot % slots_per_sector(state) == 0 && slot / slots_per_sector(state) == state->torn_sector) {
+      // the sector has only an unfinished entry in it, so erase it before using it
+      if ((state->partition_err = flash_erase(state, FLASHLOG_SLOT0 + state->torn_sector * FLASHLOG_SECTOR,
+                                              FLASHLOG_SECTOR)) != ESP_OK)
+         return FLASHLOG_ERR_ERASEERR;
+      state->torn_sector = -1; }
+   if (slot % slots_per_sector(state) == 0
+         && state->numinuse > 0 && state->oldest / slots_per_sector(state) == slot / slots_per_sector(state)) {
+      // the next slot starts a sector with the oldest entries, because the log is full
+      // or a pre-erase hasn't been done yet, so erase it now
+      if ((err = erase_oldest_sector(state)) != FLASHLOG_ERR_OK)
+         return err;
+      state->erase_pending = false; }
+   if (state->numinuse == 0) // the log was empty
+      state->oldest = slot;
+   state->newest = slot + pos / state->slotsize;
+   state->nextslot = (slot + length / state->slotsize) % state->numslots;
+   state->highest_seqno += count;
+   state->numinuse += count;
+   if (state->options & FLASHLOG_OPT_SUMMARY)
+      for (int i = 0, at = 0; i < count; ++i) {
+         struct flashlog_entry_hdr_t *entry = (struct flashlog_entry_hdr_t *)(entries + at);
+         summary_add(state, entry);
+         at += entry_slots(state, entry->length) * state->slotsize; }
+   if (state->hdrsize > FLASHLOG_ENTRY_SEQNO_SIZE) // don't write the unused end of the last entry
+      length = pos + state->hdrsize + ((struct flashlog_entry_hdr_t *)(entries + pos))->length;
+   if (state->options & FLASHLOG_OPT_COMPACT) {
+      if ((err = write_compact(state, slot, entries, count)) != FLASHLOG_ERR_OK)
+         return err; }
+   else if ((state->partition_err = flash_write(state, slot_offset(state, slot), entries, length)) != ESP_OK)
+      return FLASHLOG_ERR_WRITEERR;
+   if (state->options & FLASHLOG_OPT_COMMIT) {
+      // Now that all of the entries are there, mark them finished by clearing the pending
+      // flag in each one: programming the same bytes again with that bit clear changes only it.
+      int at = 0;
+      for (int i = 0; i < count; ++i) {
+         struct flashlog_entry_hdr_t *entry = (struct flashlog_entry_hdr_t *)(entries + at);
+         entry->flags &= ~FLASHLOG_FLAG_PENDING;
+         if (i < count - 1) at += entry_slots(state, entry->length) * state->slotsize; }
+      int first = offsetof(struct flashlog_entry_hdr_t, flags);
+      if ((state->partition_err = flash_write(state, slot_offset(state, slot) + first, entries + first,
+                                              at + sizeof(uint16_t))) != ESP_OK)
+         return FLASHLOG_ERR_WRITEERR; }
+   if (slot % slots_per_sector(state) == 0) { // these entries start a new sector
+      write_hint(state, slot, state->highest_seqno - count + 1);
+      check_preerase(state); }
+   rtc_save(state);
+   return FLASHLOG_ERR_OK; }
+
+// Write a new log entry from a buffer with room for the header. With FLASHLOG_OPT_COMPRESS
+// it's compressed into another buffer, and written that way if that makes it smaller.
+static enum flashlog_error
+write_entry (struct flashlog_state_t *state, struct flashlog_entry_hdr_t *entry) {
+   if (!(state->options & FLASHLOG_OPT_COMPRESS))
+      return write_entries(state, (char *)entry, 1);
+   struct flashlog_entry_hdr_t *packed = state->lz->entry;
+   memcpy(packed, entry, state->hdrsize);
+   int length = lz_compress(state->lz, (const uint8_t *)entry + state->hdrsize, entry->length,
+                            (uint8_t *)packed + state->hdrsize, entry->length - 1);
+   if (length >= 0) {
+      packed->length = length;
+      packed->flags &= ~FLASHLOG_FLAG_COMPRESSED; }
+   else memcpy((char *)packed + state->hdrsize, (char *)entry + state->hdrsize, entry->length);
+   enum flashlog_error err = write_entries(state, (char *)packed, 1);
+   entry->seqno = packed->seqno; // what write_entries filled in
+   if (state->options & FLASHLOG_OPT_TIMESTAMP)
+      entry->timestamp = packed->timestamp;
+   return err; }
+
+// do the pre-erase of the sector after the newest entry, if it's needed
+enum flashlog_error
+flashlog_maintain (struct flashlog_state_t *state) {
+   if (!state->entrybuf)
+      return FLASHLOG_ERR_NOINIT;
+   enum flashlog_error err = FLASHLOG_ERR_OK;
+   state_lock(state);
+   if (state->erase_pending) {
+      if ((err = erase_oldest_sector(state)) == FLASHLOG_ERR_OK)
+         state->erase_pending = false;
+      rtc_save(state); }
+   state_unlock(state);
+   return err; }
+
 // add a new log entry using the data at state->logdata
 enum flashlog_error
 flashlog_add (struct flashlog_state_t *state) {
+   return flashlog_add_length(state, state->datasize); }
+
+// add a new log entry using "length" bytes of data at state->logdata
+enum flashlog_error
+flashlog_add_length (struct flashlog_state_t *state, int length) {
+   return flashlog_add_time(state, length, (uint32_t)time(NULL)); }
+
+// add a new log entry using "length" bytes of data at state->logdata, with a timestamp
+enum flashlog_error
+flashlog_add_time (struct flashlog_state_t *state, int length, uint32_t timestamp) {
    if (!state->entrybuf)
       return FLASHLOG_ERR_NOINIT;
-   if (state->numinuse > 0) { // not empty, so add after newest
-      if (++state->newest >= state->numslots) state->newest = 0; }
-   int offset = FLASHLOG_SLOT0 + state->newest * (state->datasize + sizeof(struct flashlog_entry_hdr_t));
-   int length = state->datasize + sizeof(struct flashlog_entry_hdr_t);
-   if (state->numinuse == state->numslots) {
-      // log is full: erase the oldest 4K and adjust for the entries thus deleted
-      if ((state->partition_err = esp_partition_erase_range(state->partition, offset, 4096)) != ESP_OK)
-         return FLASHLOG_ERR_ERASEERR;
-      state->numinuse -= 4096 / length;
-      state->oldest += 4096 / length;
-      if (state->oldest >= state->numslots) state->oldest -= state->numslots; }
-   state->entrybuf->seqno = ++state->highest_seqno; // assign a new sequence number
-   ++state->numinuse;
-   if ((state->partition_err = esp_partition_write(state->partition, offset, state->entrybuf, length)) != ESP_OK)
-      return FLASHLOG_ERR_WRITEERR;
-   return FLASHLOG_ERR_OK; };
+   if (length < 0 || length > state->datasize)
+      return FLASHLOG_ERR_BADSIZE;
+#ifdef FLASHLOG_STATS
+   uint32_t start = cycle_count();
+#endif
+   if (state->async) // keep the entries in order
+      flashlog_flush(state);
+   state_lock(state);
+   if (state->hdrsize > FLASHLOG_ENTRY_SEQNO_SIZE)
+      state->entrybuf->length = length;
+   if (state->options & FLASHLOG_OPT_TIMESTAMP)
+      state->entrybuf->timestamp = timestamp;
+   if (state->hdrsize > FLASHLOG_ENTRY_SEQNO_SIZE)
+      state->entrybuf->flags = 0xffff; // flashlog_read may have changed it
+   enum flashlog_error err = write_entry(state, state->entrybuf);
+#ifdef FLASHLOG_STATS
+   histogram_add(state->stats.add_cycles, cycle_count() - start);
+#endif
+   state_unlock(state);
+   return err; };
+
+// Add "count" new log entries whose data is consecutive in memory. All the entries that
+// go into the same sector are written with one esp_partition_write, using a buffer that
+// has room for their headers. Compressed entries are written one at a time, because how
+// many fit isn't known until each one is compressed.
+enum flashlog_error
+flashlog_add_many (struct flashlog_state_t *state, const void *entries, int count) {
+   if (!state->entrybuf)
+      return FLASHLOG_ERR_NOINIT;
+   int nslots = entry_slots(state, state->datasize); // how many slots each entry takes
+   int entrysize = nslots * state->slotsize;
+   int maxrun = slots_per_sector(state) / nslots; // the most entries that fit in a sector
+   if (maxrun > count) maxrun = count;
+   int extra = state->options & FLASHLOG_OPT_COMPACT ? state->hdrsize : 0; // the only header, for compact entries
+   char *buf;
+   if (count <= 0)
+      return FLASHLOG_ERR_OK;
+   if (!(buf = (char *)malloc(maxrun * entrysize + extra)))
+      return FLASHLOG_ERR_NOMEM;
+   memset(buf, 0xff, maxrun * entrysize + extra); // leave any padding after variable-length records erased
+   if (state->async) // keep the entries in order
+      flashlog_flush(state);
+   enum flashlog_error err = FLASHLOG_ERR_OK;
+   uint32_t now = (uint32_t)time(NULL);
+   state_lock(state);
+   for (int done = 0; done < count && err == FLASHLOG_ERR_OK; ) {
+      int slot = fit_slot(state, nslots);
+      int run = (slots_per_sector(state) - slot % slots_per_sector(state)) / nslots; // room left in the sector
+      if (run > count - done) run = count - done;
+      if (state->options & FLASHLOG_OPT_COMPRESS) run = 1;
+      for (int i = 0; i < run; ++i) {
+         struct flashlog_entry_hdr_t *entry = (struct flashlog_entry_hdr_t *)(buf + i * entrysize);
+         if (state->hdrsize > FLASHLOG_ENTRY_SEQNO_SIZE) {
+            entry->length = state->datasize;
+            entry->flags = 0xffff; } // a committed batch clears the pending flags
+         if (state->options & FLASHLOG_OPT_TIMESTAMP)
+            entry->timestamp = now;
+         memcpy((char *)entry + state->hdrsize, (const char *)entries + (done + i) * state->datasize, state->datasize); }
+      err = state->options & FLASHLOG_OPT_COMPRESS ? write_entry(state, (struct flashlog_entry_hdr_t *)buf)
+            : write_entries(state, buf, run);
+      done += run; }
+   state_unlock(state);
+   free(buf);
+   return err; }
+
+// give the compressor a dictionary, and make the hash table for finding matches in it
+enum flashlog_error
+flashlog_set_dictionary (struct flashlog_state_t *state, const void *dictionary, int length) {
+   if (!state->entrybuf)
+      return FLASHLOG_ERR_NOINIT;
+   if (!state->lz)
+      return FLASHLOG_ERR_NOTSUPP;
+   if (length < 0 || length > FLASHLOG_DICT_MAX || (length > 0 && !dictionary))
+      return FLASHLOG_ERR_BADSIZE;
+   state_lock(state);
+   struct flashlog_lz_t *lz = state->lz;
+   lz->dict = length > 0 ? (const uint8_t *)dictionary : NULL;
+   lz->dictlen = length;
+   memset(lz->dict_table, 0, sizeof(lz->dict_table));
+   for (int i = 0; i + FLASHLOG_LZ_MINMATCH <= length; ++i)
+      lz->dict_table[lz_hash(lz->dict + i)] = i + 1; // the latest, which is the closest to the entry
+   state_unlock(state);
+   return FLASHLOG_ERR_OK; }
+
+// Deferred formatting for flashlog_logf. Making an entry and turning it back into text both
+// walk the format string one conversion at a time, and must agree on what each one stores.
+struct conversion_t {
+   const char *start;        // the '%'
+   const char *modifier;     // the length modifier, or the conversion character if there isn't one
+   const char *end;          // just after the conversion character
+   int stars;                // how many '*' widths and precisions it has, each an int argument
+   int size;                 // how many bytes its argument takes in an entry, if it's a number
+   char type; };             // 'i', 'u', 'f', 'c', 'p', 's', 'n', or 0 if we don't know it
+
+// find the first conversion at or after "p" in a format string, or return false if there isn't one
+static bool
+next_conversion (const char *p, struct conversion_t *conv) {
+   while (*p && (*p != '%' || p[1] == '%'))
+      p += *p == '%' ? 2 : 1;
+   if (!*p) return false;
+   conv->start = p++;
+   conv->stars = 0;
+   while (*p && strchr("-+ #0", *p)) ++p; // flags
+   if (*p == '*') ++conv->stars, ++p; // width
+   else while (*p >= '0' && *p <= '9') ++p;
+   if (*p == '.') { // precision
+      if (*++p == '*') ++conv->stars, ++p;
+      else while (*p >= '0' && *p <= '9') ++p; }
+   conv->modifier = p;
+   while (*p && strchr("hljztL", *p)) ++p;
+   bool wide = (p - conv->modifier == 2 && conv->modifier[0] == 'l') || *conv->modifier == 'j';
+   conv->size = 4;
+   switch (*p) {
+   case 'd': case 'i': conv->type = 'i'; conv->size = wide ? 8 : 4; break;
+   case 'u': case 'o': case 'x': case 'X': conv->type = 'u'; conv->size = wide ? 8 : 4; break;
+   case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A': conv->type = 'f'; conv->size = 8; break;
+   case 'c': conv->type = 'c'; break;
+   case 'p': conv->type = 'p'; break;
+   case 's': conv->type = 's'; conv->size = 0; break;
+   case 'n': conv->type = 'n'; conv->size = 0; break;
+   default: conv->type = 0; conv->size = 0; }
+   conv->end = *p ? p + 1 : p;
+   return true; }
+
+// Put the ID of a format string and its arguments into an entry of up to "size" bytes, and
+// return how many bytes that took, -1 if they don't fit, or -2 if the format has a conversion
+// we don't know, whose argument we couldn't skip without getting the ones after it wrong.
+static int
+pack_args (char *entry, int size, const char *format, va_list args) {
+   struct conversion_t conv;
+   uint32_t id = flashlog_format_id(format);
+   int length = sizeof(id);
+   if (size < length) return -1;
+   memcpy(entry, &id, sizeof(id));
+   for (const char *p = format; next_conversion(p, &conv); p = conv.end) {
+      if (conv.type == 0) return -2;
+      for (int i = 0; i < conv.stars; ++i) {
+         int star = va_arg(args, int);
+         if (length + (int)sizeof(star) > size) return -1;
+         memcpy(entry + length, &star, sizeof(star));
+         length += sizeof(star); }
+      if (conv.type == 's') { // a length byte and as much of the string as fits
+         const char *str = va_arg(args, const char *);
+         if (!str) str = "(null)";
+         int n = strlen(str);
+         if (length >= size) return -1;
+         if (n > 255) n = 255;
+         if (n > size - length - 1) n = size - length - 1;
+         entry[length++] = (char)n;
+         memcpy(entry + length, str, n);
+         length += n; }
+      else if (conv.type == 'n')
+         (void)va_arg(args, void *);
+      else if (conv.size > 0) {
+         union { uint32_t u32; uint64_t u64; double d; } value;
+         char modifier = *conv.modifier;
+         if (conv.type == 'f') value.d = modifier == 'L' ? (double)va_arg(args, long double) : va_arg(args, double);
+         else if (conv.type == 'p') value.u32 = (uint32_t)(uintptr_t)va_arg(args, void *);
+         else if (conv.size == 8) value.u64 = modifier == 'j' ? (uint64_t)va_arg(args, intmax_t) : (uint64_t)va_arg(args, long long);
+         else if (modifier == 'l') value.u32 = (uint32_t)va_arg(args, long);
+         else if (modifier == 'z') value.u32 = (uint32_t)va_arg(args, size_t);
+         else if (modifier == 't') value.u32 = (uint32_t)va_arg(args, ptrdiff_t);
+         else value.u32 = (uint32_t)va_arg(args, int);
+         if (length + conv.size > size) return -1;
+         memcpy(entry + length, &value, conv.size);
+         length += conv.size; } }
+   return length; }
+
+// the FNV-1a hash of a format string, which is its ID in entries made by flashlog_logf
+uint32_t
+flashlog_format_id (const char *format) {
+   uint32_t hash = 2166136261u;
+   for (const uint8_t *p = (const uint8_t *)format; *p; ++p)
+      hash = (hash ^ *p) * 16777619u;
+   return hash; }
+
+// add a log entry with a format string's ID and its arguments, to be formatted later
+enum flashlog_error
+flashlog_logf (struct flashlog_state_t *state, const char *format, ...) {
+   if (!state->entrybuf)
+      return FLASHLOG_ERR_NOINIT;
+   va_list args;
+   va_start(args, format);
+   int length = pack_args((char *)state->logdata, state->datasize, format, args);
+   va_end(args);
+   if (length < 0)
+      return length == -2 ? FLASHLOG_ERR_NOTSUPP : FLASHLOG_ERR_BADSIZE;
+   return flashlog_add_length(state, length); }
+
+// add a character to the text being made by flashlog_format_entry
+static void
+put_char (char *buf, int size, int *out, char c) {
+   if (*out < size - 1) buf[*out] = c;
+   ++*out; }
+
+// turn an entry made by flashlog_logf back into text
+int
+flashlog_format_entry (const char *format, const void *data, int length, char *buf, int size) {
+   const char *entry = (const char *)data;
+   struct conversion_t conv;
+   uint32_t id;
+   int pos = sizeof(id), out = 0;
+   if (length < pos) return -1;
+   memcpy(&id, entry, sizeof(id));
+   if (id != flashlog_format_id(format)) return -1;
+   for (const char *p = format; ; p = conv.end) {
+      bool more = next_conversion(p, &conv);
+      for (const char *upto = more ? conv.start : p + strlen(p); p < upto; ++p) { // the text before it
+         put_char(buf, size, &out, *p);
+         if (*p == '%') ++p; } // "%%" is one '%'
+      if (!more) break;
+      int stars[2];
+      for (int i = 0; i < conv.stars; ++i) {
+         if (pos + (int)sizeof(stars[i]) > length) return -1;
+         memcpy(&stars[i], entry + pos, sizeof(stars[i]));
+         pos += sizeof(stars[i]); }
+      // the conversion with its flags, width, and precision, but a length modifier for what we have
+      char spec[40], str[256];
+      int n = conv.modifier - conv.start;
+      if (n > (int)sizeof(spec) - 5 || (conv.size > 0 && pos + conv.size > length)) return -1;
+      memcpy(spec, conv.start, n);
+      spec[n] = '\0';
+      union { int32_t i32; uint32_t u32; int64_t i64; uint64_t u64; double d; } value;
+      if (conv.size > 0) memcpy(&value, entry + pos, conv.size);
+      pos += conv.size;
+      char *dst = out < size ? buf + out : NULL;
+      int room = out < size ? size - out : 0;
+#define FORMAT(value) (conv.stars == 0 ? snprintf(dst, room, spec, value) \
+                       : conv.stars == 1 ? snprintf(dst, room, spec, stars[0], value) \
+                       : snprintf(dst, room, spec, stars[0], stars[1], value))
+      switch (conv.type) {
+      case 'i':
+         strcat(spec, "ll");
+         strncat(spec, conv.end - 1, 1);
+         out += FORMAT(conv.size == 8 ? (long long)value.i64 : (long long)value.i32);
+         break;
+      case 'u':
+         strcat(spec, "ll");
+         strncat(spec, conv.end - 1, 1);
+         out += FORMAT(conv.size == 8 ? (unsigned long long)value.u64 : (unsigned long long)value.u32);
+         break;
+      case 'f':
+         strncat(spec, conv.end - 1, 1);
+         out += FORMAT(value.d);
+         break;
+      case 'c':
+         strcat(spec, "c");
+         out += FORMAT(value.i32);
+         break;
+      case 'p':
+         strcat(spec, "#lx");
+         out += FORMAT((unsigned long)value.u32);
+         break;
+      case 's':
+         if (pos >= length || pos + 1 + (uint8_t)entry[pos] > length) return -1;
+         n = (uint8_t)entry[pos++];
+         memcpy(str, entry + pos, n);
+         str[n] = '\0';
+         pos += n;
+         strcat(spec, "s");
+         out += FORMAT(str);
+         break;
+      case 'n':
+         break;
+      default: // we don't know what it is, so show it as it is
+         for (const char *q = conv.start; q < conv.end; ++q)
+            put_char(buf, size, &out, *q); } }
+#undef FORMAT
+   if (size > 0) buf[out < size ? out : size - 1] = '\0';
+   return out; }
+
+// check that a slot holds an entry that is in use
+static bool
+slot_in_use (struct flashlog_state_t *state, int slot) {
+   if (state->numinuse == 0) return false;
+   if (state->newest >= state->oldest) return slot >= state->oldest && slot <= state->newest;
+   return slot >= 0 && slot < state->numslots && (slot <= state->newest || slot >= state->oldest); }
 
 // read log entry number state->current into state->logdata
 enum flashlog_error
 flashlog_read(struct flashlog_state_t *state) {
    if (!state->entrybuf)
       return FLASHLOG_ERR_NOINIT;
-   int current = state->current;
-   if (state->numinuse == 0
-   || (state->newest >= state->oldest && (current < state->oldest || current > state->newest))
-   || (state->newest < state->oldest && (current >= state->numslots || state->current < 0) || (current > state->newest && current < state->oldest)))
-      return FLASHLOG_ERR_BADSLOT;
-   int length = state->datasize + sizeof(struct flashlog_entry_hdr_t);
-   int offset = FLASHLOG_SLOT0 + state->current * (state->datasize + sizeof(struct flashlog_entry_hdr_t));
-   if ((state->partition_err = esp_partition_read(state->partition, offset, state->entrybuf, length)) != ESP_OK)
-      return FLASHLOG_ERR_READERR;
-   return FLASHLOG_ERR_OK; }
+   enum flashlog_error err = FLASHLOG_ERR_OK;
+#ifdef FLASHLOG_STATS
+   uint32_t start = cycle_count();
+#endif
+   state_lock(state);
+   if (!slot_in_use(state, state->current))
+      err = FLASHLOG_ERR_BADSLOT;
+   else if (state->options & FLASHLOG_OPT_COMPACT) {
+      // there's no header, but the slots from the oldest to the newest are all in use
+      if ((state->partition_err = cached_read(state, slot_offset(state, state->current), state->logdata,
+                                              state->datasize)) != ESP_OK)
+         err = FLASHLOG_ERR_READERR;
+      state->entrybuf->seqno = state->highest_seqno - (state->newest - state->current + state->numslots) % state->numslots;
+      state->datalen = state->datasize; }
+   else {
+      int offset = slot_offset(state, state->current);
+      int length = state->hdrsize + state->datasize;
+      // If entries have lengths and can be big, read the header first so that we then
+      // read only the data that is there. Otherwise read it all at once.
+      bool split = state->hdrsize > FLASHLOG_ENTRY_SEQNO_SIZE && length > FLASHLOG_READ_ONCE;
+      if (split)
+         length = state->hdrsize;
+      else if (offset % FLASHLOG_SECTOR + length > FLASHLOG_SECTOR) // a short record at the end of a sector
+         length = FLASHLOG_SECTOR - offset % FLASHLOG_SECTOR;
+      if ((state->partition_err = cached_read(state, offset, state->entrybuf, length)) != ESP_OK)
+         err = FLASHLOG_ERR_READERR;
+      else {
+         state->datalen = state->datasize;
+         if (state->hdrsize > FLASHLOG_ENTRY_SEQNO_SIZE && state->entrybuf->length < state->datasize)
+            state->datalen = state->entrybuf->length;
+         if (split && state->datalen > 0
+               && (state->partition_err = cached_read(state, offset + state->hdrsize,
+                                          state->logdata, state->datalen)) != ESP_OK)
+            err = FLASHLOG_ERR_READERR;
+         else if ((state->options & FLASHLOG_OPT_CRC) && entry_crc(state, state->entrybuf) != state->entrybuf->crc)
+            err = FLASHLOG_ERR_CRC;
+         else if ((state->options & FLASHLOG_OPT_COMPRESS) && !(state->entrybuf->flags & FLASHLOG_FLAG_COMPRESSED)) {
+            // move the compressed data out of the way and decompress it into state->logdata
+            uint8_t *packed = (uint8_t *)state->lz->entry + state->hdrsize;
+            memcpy(packed, state->logdata, state->datalen);
+            int unpacked = lz_decompress(state->lz, packed, state->datalen, (uint8_t *)state->logdata, state->datasize);
+            if (unpacked < 0) err = FLASHLOG_ERR_BADDATA;
+            else state->datalen = unpacked; } } }
+#ifdef FLASHLOG_STATS
+   histogram_add(state->stats.read_cycles, cycle_count() - start);
+#endif
+   state_unlock(state);
+   return err; }
+
+// Read up to "max_entries" consecutive entries starting with sequence number "start_seqno",
+// or the oldest entry if that one is gone, into "buf". Because the slots of a fixed-size log
+// are contiguous in the partition, that is one read, or two if the entries wrap around.
+enum flashlog_error
+flashlog_read_range (struct flashlog_state_t *state, uint32_t start_seqno, int max_entries, void *buf,
+                     int *count, uint32_t *next_seqno) {
+   if (!state->entrybuf)
+      return FLASHLOG_ERR_NOINIT;
+   if (state->options & (FLASHLOG_OPT_VARLEN | FLASHLOG_OPT_SUMMARY | FLASHLOG_OPT_COMMIT | FLASHLOG_OPT_COMPACT
+                         | FLASHLOG_OPT_COMPRESS))
+      return FLASHLOG_ERR_NOTSUPP;
+   enum flashlog_error err = FLASHLOG_ERR_OK;
+   state_lock(state);
+   uint32_t oldest_seqno = state->highest_seqno - state->numinuse + 1;
+   if (state->numinuse == 0 || start_seqno < oldest_seqno)
+      start_seqno = oldest_seqno;
+   int n = 0;
+   if (state->numinuse > 0 && start_seqno <= state->highest_seqno && max_entries > 0) {
+      n = state->highest_seqno - start_seqno + 1 < (uint32_t)max_entries ? state->highest_seqno - start_seqno + 1 : max_entries;
+      int slot = (state->oldest + (start_seqno - oldest_seqno)) % state->numslots;
+      int first = state->numslots - slot < n ? state->numslots - slot : n; // how many before the wrap
+      if ((state->partition_err = flash_read(state, slot_offset(state, slot), buf, first * state->slotsize)) != ESP_OK
+            || (n > first
+                && (state->partition_err = flash_read(state, slot_offset(state, 0), (char *)buf + first * state->slotsize,
+                                                      (n - first) * state->slotsize)) != ESP_OK)) {
+         err = FLASHLOG_ERR_READERR;
+         n = 0; } }
+   *count = n;
+   *next_seqno = start_seqno + n;
+   state_unlock(state);
+   return err; }
+
+// point to log entry number state->current in the mapped partition
+enum flashlog_error
+flashlog_read_mapped (struct flashlog_state_t *state, const struct flashlog_entry_hdr_t **entry) {
+   if (!state->entrybuf)
+      return FLASHLOG_ERR_NOINIT;
+   if (!state->mapped)
+      return FLASHLOG_ERR_NOMAP;
+   if (state->options & (FLASHLOG_OPT_COMPACT | FLASHLOG_OPT_COMPRESS)) // no header to point to, or data to give
+      return FLASHLOG_ERR_NOTSUPP;
+   enum flashlog_error err = FLASHLOG_ERR_OK;
+   state_lock(state);
+   if (!slot_in_use(state, state->current))
+      err = FLASHLOG_ERR_BADSLOT;
+   else {
+      *entry = (const struct flashlog_entry_hdr_t *)(state->mapped + slot_offset(state, state->current));
+      state->datalen = state->datasize;
+      if (state->hdrsize > FLASHLOG_ENTRY_SEQNO_SIZE && (*entry)->length < state->datasize)
+         state->datalen = (*entry)->length;
+      if ((state->options & FLASHLOG_OPT_CRC) && entry_crc(state, *entry) != (*entry)->crc)
+         err = FLASHLOG_ERR_CRC; }
+   state_unlock(state);
+   return err; }
 
 // routines to set state->current to a specified slot
 
 enum flashlog_error flashlog_goto_newest(struct flashlog_state_t *state) {
-   if (state->numinuse == 0) return FLASHLOG_ERR_BADSLOT;
-   state->current = state->newest;
-   return FLASHLOG_ERR_OK; }
+   enum flashlog_error err = FLASHLOG_ERR_BADSLOT;
+   state_lock(state);
+   if (state->numinuse > 0) {
+      state->current = state->newest;
+      err = FLASHLOG_ERR_OK; }
+   state_unlock(state);
+   return err; }
 
 enum flashlog_error flashlog_goto_oldest(struct flashlog_state_t *state) {
-   if (state->numinuse == 0) return FLASHLOG_ERR_BADSLOT;
-   state->current = state->oldest;
+   enum flashlog_error err = FLASHLOG_ERR_BADSLOT;
+   state_lock(state);
+   if (state->numinuse > 0) {
+      state->current = state->oldest;
+      err = FLASHLOG_ERR_OK; }
+   state_unlock(state);
+   return err; }
+
+// Find the variable-length record after the one at state->current. It is right after it,
+// unless there wasn't room for it there, in which case it's at the start of the next sector.
+// With FLASHLOG_OPT_COMMIT, fixed-size entries are found this way too, because an unfinished
+// entry makes the rest of its sector a gap.
+static enum flashlog_error
+varlen_next (struct flashlog_state_t *state) {
+   struct flashlog_entry_hdr_t hdr, next_hdr;
+   enum flashlog_error err;
+   if ((err = read_hdr(state, state->current, &hdr)) != FLASHLOG_ERR_OK)
+      return err;
+   int next = state->current + entry_slots(state, hdr.length);
+   next_hdr.seqno = UINT32_MAX;
+   if (next / slots_per_sector(state) == state->current / slots_per_sector(state)
+         && next % slots_per_sector(state) * state->slotsize + state->hdrsize <= sector_end(state)
+         && (err = read_hdr(state, next, &next_hdr)) != FLASHLOG_ERR_OK)
+      return err;
+   if (hdr_seqno(state, &next_hdr) != hdr.seqno + 1) // it's in the next sector
+      next = (state->current / slots_per_sector(state) + 1) * slots_per_sector(state);
+   state->current = next >= state->numslots ? 0 : next;
    return FLASHLOG_ERR_OK; }
 
-enum flashlog_error flashlog_goto_next(struct flashlog_state_t *state) {
-   if (state->numinuse == 0
-         || state->current == state->newest)
-      return FLASHLOG_ERR_BADSLOT;
-   if (++state->current >= state->numslots) state->current = 0;
+// Read a log sector into "buf". If that's the sector buffer, the sector may already be
+// there, because it remembers which sector it holds and is kept the same as the FLASH.
+// (With FLASHLOG_OPT_CACHE, reads of single entries also use it.)
+static enum flashlog_error
+load_sector (struct flashlog_state_t *state, int sector, char *buf) {
+   if (buf == state->sectorbuf) {
+      if (state->cached_sector == sector)
+         return FLASHLOG_ERR_OK;
+      state->cached_sector = -1; }
+   if ((state->partition_err = flash_read(state, FLASHLOG_SLOT0 + sector * FLASHLOG_SECTOR, buf, FLASHLOG_SECTOR)) != ESP_OK)
+      return FLASHLOG_ERR_READERR;
+   if (buf == state->sectorbuf)
+      state->cached_sector = sector;
+   return FLASHLOG_ERR_OK; }
+
+// Find the variable-length record before the one at state->current. Records can only be
+// followed forward, so we read the sector it's in, or the previous one if it's first in its
+// sector, and walk through the records there.
+static enum flashlog_error
+varlen_prev (struct flashlog_state_t *state) {
+   int sector = state->current / slots_per_sector(state);
+   int limit = state->current % slots_per_sector(state) * state->slotsize; // where we must stop
+   enum flashlog_error err;
+   if (limit == 0) {
+      if (--sector < 0) sector = state->numslots / slots_per_sector(state) - 1;
+      limit = FLASHLOG_SECTOR; }
+   if ((err = load_sector(state, sector, state->sectorbuf)) != FLASHLOG_ERR_OK)
+      return err;
+   int prev = 0;
+   for (int pos = sector_next(state, state->sectorbuf, 0);
+         pos < limit && sector_seqno(state, state->sectorbuf, pos) != UINT32_MAX;
+         pos = sector_next(state, state->sectorbuf, pos))
+      prev = pos;
+   state->current = sector * slots_per_sector(state) + prev / state->slotsize;
    return FLASHLOG_ERR_OK; }
 
+// the sequence number or the timestamp of an entry
+static uint32_t
+entry_key (const struct flashlog_entry_hdr_t *hdr, bool by_time) {
+   return by_time ? hdr->timestamp : hdr->seqno; }
+
+// Find the oldest entry whose sequence number, or timestamp, is at least "key". Both only
+// increase from the oldest entry to the newest, so we do a binary search of the first
+// entries of the sectors in use, and then look through the sector before the first one
+// that starts with a bigger key. Sets *slot and *found to where the entry is and its key,
+// or returns FLASHLOG_ERR_BADSLOT if all the entries are older.
+static enum flashlog_error
+search_key (struct flashlog_state_t *state, bool by_time, uint32_t key, int *slot, uint32_t *found) {
+   int numsectors = state->numslots / slots_per_sector(state);
+   int oldest_sector = state->oldest / slots_per_sector(state);
+   int nused = (state->newest / slots_per_sector(state) - oldest_sector + numsectors) % numsectors + 1;
+   struct flashlog_entry_hdr_t hdr;
+   enum flashlog_error err;
+   int lo = 0, hi = nused; // find how many sectors start with an entry whose key is smaller
+   while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      if ((err = read_hdr(state, (oldest_sector + mid) % numsectors * slots_per_sector(state), &hdr)) != FLASHLOG_ERR_OK)
+         return err;
+      if (entry_key(&hdr, by_time) < key) lo = mid + 1;
+      else hi = mid; }
+   if (lo > 0) { // it's in the sector before that one, or starts the next one
+      int sector = (oldest_sector + lo - 1) % numsectors;
+      char *buf = state->sectorbuf ? state->sectorbuf : (char *)malloc(FLASHLOG_SECTOR);
+      if (!buf)
+         return FLASHLOG_ERR_NOMEM;
+      int pos = 0;
+      err = load_sector(state, sector, buf);
+      if (err == FLASHLOG_ERR_OK) {
+         while (pos < FLASHLOG_SECTOR && sector_seqno(state, buf, pos) != UINT32_MAX
+                && entry_key((const struct flashlog_entry_hdr_t *)(buf + pos), by_time) < key)
+            pos = sector_next(state, buf, pos);
+         if (pos < FLASHLOG_SECTOR && sector_seqno(state, buf, pos) != UINT32_MAX) {
+            *slot = sector * slots_per_sector(state) + pos / state->slotsize;
+            *found = entry_key((const struct flashlog_entry_hdr_t *)(buf + pos), by_time);
+            lo = -1; } } // we're done
+      if (buf != state->sectorbuf)
+         free(buf);
+      if (err != FLASHLOG_ERR_OK || lo < 0)
+         return err;
+      if (lo >= nused)
+         return FLASHLOG_ERR_BADSLOT; }
+   *slot = (oldest_sector + lo) % numsectors * slots_per_sector(state);
+   if ((err = read_hdr(state, *slot, &hdr)) != FLASHLOG_ERR_OK)
+      return err;
+   *found = entry_key(&hdr, by_time);
+   return FLASHLOG_ERR_OK; }
+
+// Go to the entry with the given sequence number. In a fixed-size log, the entries from the
+// oldest to the newest are in consecutive slots, so we can figure out where it is and check
+// that it's there with one small read. If it isn't, or if entries have variable lengths,
+// search for it.
+enum flashlog_error flashlog_goto_seqno(struct flashlog_state_t *state, uint32_t seqno) {
+   enum flashlog_error err = FLASHLOG_ERR_BADSLOT;
+   state_lock(state);
+   uint32_t oldest_seqno = state->highest_seqno - state->numinuse + 1;
+   if (state->numinuse > 0
+         && seqno >= oldest_seqno && seqno <= state->highest_seqno) {
+      int slot;
+      uint32_t found;
+      if (!(state->options & FLASHLOG_OPT_VARLEN)) {
+         slot = (state->oldest + (seqno - oldest_seqno)) % state->numslots;
+         if ((err = read_seqno(state, slot, &found)) == FLASHLOG_ERR_OK && found != seqno)
+            err = FLASHLOG_ERR_BADSLOT; }
+      if (err == FLASHLOG_ERR_BADSLOT && !(state->options & FLASHLOG_OPT_COMPACT) // it can only be there
+            && (err = search_key(state, false, seqno, &slot, &found)) == FLASHLOG_ERR_OK
+            && found != seqno)
+         err = FLASHLOG_ERR_BADSLOT;
+      if (err == FLASHLOG_ERR_OK)
+         state->current = slot; }
+   state_unlock(state);
+   return err; }
+
+// go to the oldest entry with a timestamp of at least "t"
+enum flashlog_error flashlog_goto_time(struct flashlog_state_t *state, uint32_t t) {
+   if (!(state->options & FLASHLOG_OPT_TIMESTAMP))
+      return FLASHLOG_ERR_NOTSUPP;
+   enum flashlog_error err = FLASHLOG_ERR_BADSLOT;
+   state_lock(state);
+   if (state->numinuse > 0) {
+      int slot;
+      uint32_t found;
+      if ((err = search_key(state, true, t, &slot, &found)) == FLASHLOG_ERR_OK)
+         state->current = slot; }
+   state_unlock(state);
+   return err; }
+
+// whether an entry matches a query
+static bool
+query_match (struct flashlog_state_t *state, const struct flashlog_query_t *query, const struct flashlog_entry_hdr_t *entry) {
+   return entry->seqno >= query->first_seqno && entry->seqno <= query->last_seqno
+          && (!(state->options & FLASHLOG_OPT_TIMESTAMP)
+              || (entry->timestamp >= query->start_time && entry->timestamp <= query->end_time))
+          && (entry_type_bit(state, entry) & query->types); }
+
+// Go to the first entry after sequence number "after" that matches the query, starting
+// with the sector that has slot "slot". Sectors whose summaries show that none of their
+// entries match are skipped without reading them, and once a summary shows that all the
+// entries from there on are past the range of sequence numbers or times, we stop.
+static enum flashlog_error
+query_scan (struct flashlog_state_t *state, const struct flashlog_query_t *query, int slot, uint32_t after) {
+   int numsectors = state->numslots / slots_per_sector(state);
+   int sector = slot / slots_per_sector(state);
+   int newest_sector = state->newest / slots_per_sector(state);
+   bool timed = state->options & FLASHLOG_OPT_TIMESTAMP;
+   struct flashlog_summary_t summary;
+   enum flashlog_error err = FLASHLOG_ERR_BADSLOT;
+   char *buf = state->sectorbuf ? state->sectorbuf : (char *)malloc(FLASHLOG_SECTOR);
+   if (!buf)
+      return FLASHLOG_ERR_NOMEM;
+   for (;;) {
+      bool skip = false;
+      if (sector == newest_sector) // its summary is in RAM
+         summary = state->summary;
+      else if ((state->partition_err = flash_read(state, FLASHLOG_SLOT0 + (sector + 1) * FLASHLOG_SECTOR - FLASHLOG_SUMMARY_SIZE,
+                                                  &summary, sizeof(summary))) != ESP_OK) {
+         err = FLASHLOG_ERR_READERR;
+         break; }
+      else if (summary.check != summary_check(&summary)) // not written or damaged, so look at the entries
+         summary.first_seqno = UINT32_MAX;
+      if (summary.first_seqno != UINT32_MAX) {
+         if (summary.first_seqno > query->last_seqno || (timed && summary.min_time > query->end_time))
+            break; // this and all the later entries are past the range
+         skip = summary.last_seqno <= after || summary.last_seqno < query->first_seqno
+                || (timed && summary.max_time < query->start_time) || !(summary.types & query->types); }
+      if (!skip) {
+         if ((err = load_sector(state, sector, buf)) != FLASHLOG_ERR_OK)
+            break;
+         err = FLASHLOG_ERR_BADSLOT;
+         for (int pos = 0; pos < FLASHLOG_SECTOR && sector_seqno(state, buf, pos) != UINT32_MAX; pos = sector_next(state, buf, pos)) {
+            const struct flashlog_entry_hdr_t *entry = (const struct flashlog_entry_hdr_t *)(buf + pos);
+            if (entry->seqno > state->highest_seqno)
+               break; // left over from before the sector was reused, in a damaged log
+            if (entry->seqno > after && query_match(state, query, entry)) {
+               state->current = sector * slots_per_sector(state) + pos / state->slotsize;
+               err = FLASHLOG_ERR_OK;
+               break; } }
+         if (err == FLASHLOG_ERR_OK)
+            break; }
+      if (sector == newest_sector)
+         break;
+      sector = (sector + 1) % numsectors; }
+   if (buf != state->sectorbuf)
+      free(buf);
+   return err; }
+
+// go to the oldest entry that matches a query
+enum flashlog_error flashlog_query_first(struct flashlog_state_t *state, const struct flashlog_query_t *query) {
+   if (!(state->options & FLASHLOG_OPT_SUMMARY))
+      return FLASHLOG_ERR_NOTSUPP;
+   enum flashlog_error err = FLASHLOG_ERR_BADSLOT;
+   state_lock(state);
+   if (state->numinuse > 0) {
+      int slot = state->oldest;
+      uint32_t found;
+      err = FLASHLOG_ERR_OK;
+      if ((state->options & FLASHLOG_OPT_TIMESTAMP) && query->start_time > 0) // start near the first time that matches
+         err = search_key(state, true, query->start_time, &slot, &found);
+      if (err == FLASHLOG_ERR_OK)
+         err = query_scan(state, query, slot, state->highest_seqno - state->numinuse); }
+   state_unlock(state);
+   return err; }
+
+// go to the next entry after state->current that matches a query
+enum flashlog_error flashlog_query_next(struct flashlog_state_t *state, const struct flashlog_query_t *query) {
+   if (!(state->options & FLASHLOG_OPT_SUMMARY))
+      return FLASHLOG_ERR_NOTSUPP;
+   enum flashlog_error err = FLASHLOG_ERR_BADSLOT;
+   state_lock(state);
+   uint32_t seqno;
+   if (state->numinuse > 0 && slot_in_use(state, state->current) && state->current != state->newest
+         && (err = read_seqno(state, state->current, &seqno)) == FLASHLOG_ERR_OK)
+      err = query_scan(state, query, state->current, seqno);
+   state_unlock(state);
+   return err; }
+
+enum flashlog_error flashlog_goto_next(struct flashlog_state_t *state) {
+   enum flashlog_error err = FLASHLOG_ERR_BADSLOT;
+   state_lock(state);
+   if (state->numinuse > 0
+         && state->current != state->newest) {
+      if (state->options & (FLASHLOG_OPT_VARLEN | FLASHLOG_OPT_COMMIT))
+         err = varlen_next(state);
+      else {
+         if (++state->current >= state->numslots) state->current = 0;
+         err = FLASHLOG_ERR_OK; } }
+   state_unlock(state);
+   return err; }
+
 enum flashlog_error flashlog_goto_prev(struct flashlog_state_t *state) {
-   if (state->numinuse == 0
-         || state->current == state->oldest)
-      return FLASHLOG_ERR_BADSLOT;
-   if (--state->current < 0) state->current = state->numslots - 1;
+   enum flashlog_error err = FLASHLOG_ERR_BADSLOT;
+   state_lock(state);
+   if (state->numinuse > 0
+         && state->current != state->oldest) {
+      if (state->options & (FLASHLOG_OPT_VARLEN | FLASHLOG_OPT_COMMIT))
+         err = varlen_prev(state);
+      else {
+         if (--state->current < 0) state->current = state->numslots - 1;
+         err = FLASHLOG_ERR_OK; } }
+   state_unlock(state);
+   return err; }
+
+#ifdef FLASHLOG_STATS
+// get a copy of the operation counts and latency histograms
+enum flashlog_error
+flashlog_get_stats (struct flashlog_state_t *state, struct flashlog_stats_t *stats) {
+   state_lock(state);
+   *stats = state->stats;
+   state_unlock(state);
+   return FLASHLOG_ERR_OK; }
+
+enum flashlog_error
+flashlog_reset_stats (struct flashlog_state_t *state) {
+   state_lock(state);
+   memset(&state->stats, 0, sizeof(state->stats));
+   state_unlock(state);
+   return FLASHLOG_ERR_OK; }
+#endif
+
+// Asynchronous adds. flashlog_add_async copies the entry into the queue, and the writer
+// task takes entries from the queue and writes them to the log. On the ESP32 the writer
+// is a FreeRTOS task; elsewhere it is a thread.
+
+static void
+queue_lock (struct flashlog_async_t *async) {
+#ifdef ESP_PLATFORM
+   xSemaphoreTake(async->queue_lock, portMAX_DELAY);
+#else
+   async->queue_lock.lock();
+#endif
+}
+
+static void
+queue_unlock (struct flashlog_async_t *async) {
+#ifdef ESP_PLATFORM
+   xSemaphoreGive(async->queue_lock);
+#else
+   async->queue_lock.unlock();
+#endif
+}
+
+// tell the writer, and anybody waiting for the queue to drain, that the queue has changed
+static void
+queue_changed (struct flashlog_async_t *async) {
+#ifdef ESP_PLATFORM
+   xTaskNotifyGive(async->task);
+#else
+   async->changed.notify_all();
+#endif
+}
+
+// wait for the queue to change, with the queue lock held
+static void
+queue_wait (struct flashlog_async_t *async, bool writer) {
+#ifdef ESP_PLATFORM
+   queue_unlock(async);
+   if (writer) ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+   else vTaskDelay(1);
+   queue_lock(async);
+#else
+   (void)writer;
+   std::unique_lock<std::mutex> lock(async->queue_lock, std::adopt_lock);
+   async->changed.wait(lock);
+   lock.release();
+#endif
+}
+
+// the writer task, which writes queued entries until it is told to stop
+static void
+async_writer (void *param) {
+   struct flashlog_state_t *state = (struct flashlog_state_t *)param;
+   struct flashlog_async_t *async = state->async;
+   int entrysize = state->datasize + state->hdrsize;
+   queue_lock(async);
+   while (async->count > 0 || !async->stop) {
+      if (async->count == 0) { // idle, so wait; the pre-erase is left to flashlog_maintain
+         queue_wait(async, true);
+         continue; }
+      // The entry stays in the queue while we write it, so the queue lock can be released.
+      struct flashlog_entry_hdr_t *entry = (struct flashlog_entry_hdr_t *)(async->queue + async->head * entrysize);
+      queue_unlock(async);
+      state_lock(state);
+      enum flashlog_error err = write_entry(state, entry);
+      state_unlock(state);
+      queue_lock(async);
+      if (err != FLASHLOG_ERR_OK && async->err == FLASHLOG_ERR_OK)
+         async->err = err;
+      if (++async->head >= async->queuesize) async->head = 0;
+      --async->count;
+#ifndef ESP_PLATFORM
+      queue_changed(async);
+#endif
+   }
+   async->running = false;
+   queue_unlock(async);
+#ifdef ESP_PLATFORM
+   vTaskDelete(NULL);
+#endif
+}
+
+// start asynchronous adds, with a queue for the specified number of entries
+enum flashlog_error
+flashlog_async_start (struct flashlog_state_t *state, int queuesize, int core) {
+   if (!state->entrybuf)
+      return FLASHLOG_ERR_NOINIT;
+   if (state->async)
+      return FLASHLOG_ERR_OK;
+   struct flashlog_async_t *async = new (std::nothrow) struct flashlog_async_t;
+   if (!async)
+      return FLASHLOG_ERR_NOMEM;
+   if (!(async->queue = (char *)malloc(queuesize * (state->datasize + state->hdrsize)))) {
+      delete async;
+      return FLASHLOG_ERR_NOMEM; }
+   async->queuesize = queuesize;
+   async->head = async->count = 0;
+   async->err = FLASHLOG_ERR_OK;
+   async->stop = false;
+   async->running = true;
+   state->async = async;
+#ifdef ESP_PLATFORM
+   async->queue_lock = xSemaphoreCreateMutex();
+   async->state_lock = xSemaphoreCreateMutex();
+   if (!async->queue_lock || !async->state_lock
+         || xTaskCreatePinnedToCore(async_writer, "flashlog", FLASHLOG_TASK_STACK, state, FLASHLOG_TASK_PRIORITY,
+                                    &async->task, core < 0 ? tskNO_AFFINITY : core) != pdPASS) {
+      if (async->queue_lock) vSemaphoreDelete(async->queue_lock);
+      if (async->state_lock) vSemaphoreDelete(async->state_lock);
+      state->async = NULL;
+      free(async->queue);
+      delete async;
+      return FLASHLOG_ERR_NOMEM; }
+#else
+   (void)core; // threads aren't pinned
+   async->task = std::thread(async_writer, (void *)state);
+#endif
    return FLASHLOG_ERR_OK; }
 
+// queue a copy of the entry at state->logdata to be added to the log
+enum flashlog_error
+flashlog_add_async (struct flashlog_state_t *state) {
+   if (!state->entrybuf)
+      return FLASHLOG_ERR_NOINIT;
+   struct flashlog_async_t *async = state->async;
+   if (!async)
+      return flashlog_add(state);
+   int entrysize = state->datasize + state->hdrsize;
+   queue_lock(async);
+   if (async->count >= async->queuesize) {
+      queue_unlock(async);
+      return FLASHLOG_ERR_QUEUEFULL; }
+   if (state->hdrsize > FLASHLOG_ENTRY_SEQNO_SIZE) {
+      state->entrybuf->length = state->datasize;
+      state->entrybuf->flags = 0xffff; }
+   if (state->options & FLASHLOG_OPT_TIMESTAMP) // the time it was queued, not written
+      state->entrybuf->timestamp = (uint32_t)time(NULL);
+   int tail = (async->head + async->count) % async->queuesize;
+   memcpy(async->queue + tail * entrysize, state->entrybuf, entrysize);
+   ++async->count;
+   queue_changed(async);
+   queue_unlock(async);
+   return FLASHLOG_ERR_OK; }
+
+// wait until all the queued entries have been written
+enum flashlog_error
+flashlog_flush (struct flashlog_state_t *state) {
+   struct flashlog_async_t *async = state->async;
+   if (!async)
+      return FLASHLOG_ERR_OK;
+   queue_lock(async);
+   while (async->count > 0)
+      queue_wait(async, false);
+   enum flashlog_error err = async->err;
+   async->err = FLASHLOG_ERR_OK;
+   queue_unlock(async);
+   return err; }
+
+// return how many entries are waiting to be written
+int
+flashlog_queue_depth (struct flashlog_state_t *state) {
+   struct flashlog_async_t *async = state->async;
+   if (!async)
+      return 0;
+   queue_lock(async);
+   int count = async->count;
+   queue_unlock(async);
+   return count; }
+
+// write all the queued entries, then stop the writer and free the queue
+enum flashlog_error
+flashlog_async_stop (struct flashlog_state_t *state) {
+   struct flashlog_async_t *async = state->async;
+   if (!async)
+      return FLASHLOG_ERR_OK;
+   enum flashlog_error err = flashlog_flush(state);
+   queue_lock(async);
+   async->stop = true;
+   queue_changed(async);
+   queue_unlock(async);
+#ifdef ESP_PLATFORM
+   queue_lock(async);
+   while (async->running) {
+      queue_unlock(async);
+      vTaskDelay(1);
+      queue_lock(async); }
+   queue_unlock(async);
+   vSemaphoreDelete(async->queue_lock);
+   vSemaphoreDelete(async->state_lock);
+#else
+   async->task.join();
+#endif
+   state->async = NULL;
+   free(async->queue);
+   delete async;
+   return err; }
+
 //*
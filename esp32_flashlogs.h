@@ -28,23 +28,77 @@
 #include <esp_partition.h>
 #define ESP_PARTITION_TYPE_LOG (esp_partition_type_t)0x4D
 
+// Define this to count the FLASH operations and time the calls for each log; see flashlog_get_stats.
+// It must be defined here, or for every file that includes this one.
+//#define FLASHLOG_STATS
+
 // This is the flash-resident header at the beginning of the log.
 // This is written when the log is created, but it does not need to be
 // updated as entries are added, which limits wear on the NOR flash memory.
 struct flashlog_hdr_t {
    char id[8];              //"flashlog", so we can recognize an initialized log
    int datasize;            // the size of the user data in each log entry
-   int numslots; };         // the total number of slots in the log
+   int numslots;            // the total number of slots in the log
+   int options; };          // the FLASHLOG_OPT_xxx options that change the format of the log
 #define FLASHLOG_ID "flashlog"
+
+// The rest of the first sector, which holds the header, is used as an append-only area
+// of "open hints". Each time an entry is added at the start of a sector, flashlog_add
+// writes a hint to an erased spot, so flashlog_open can usually start from the last
+// hint and only needs to check the sector it names instead of searching the log. When
+// all FLASHLOG_NUMHINTS are used, the header sector is erased and the header rewritten.
+struct flashlog_hint_t {
+   int newest;              // the slot of an entry at the start of a sector
+   uint32_t seqno; };       // and its sequence number
+#define FLASHLOG_HINT0 64   // the offset in the partition where the first hint is
+#define FLASHLOG_NUMHINTS ((int)((4096 - FLASHLOG_HINT0) / sizeof(struct flashlog_hint_t)))
 #define FLASHLOG_SLOT0 4096 // the offset in the partition where slot 0 starts
+#define FLASHLOG_SECTOR 4096 // the FLASH erase block size
+#define FLASHLOG_SCANSIZE 4096 // how much to read at a time when scanning the log at open; at least a sector
+#define FLASHLOG_READ_ONCE 64 // entries with lengths up to this size are read with their header in one read
 
 // This is the header at the start of each log entry.
-// It currently only stores a sequence number that gives the absolute "age"
+// It stores a sequence number that gives the absolute "age"
 // of the entry. (It will wrap around and fail after 4 billion log entries,
 // but the FLASH memory will probably have failed before then.)
+// The fields after the sequence number are only in the log for some options;
+// FLASHLOG_HDRSIZE says how much of the header is used.
 struct flashlog_entry_hdr_t  {
-   uint32_t seqno; };       // 0 for an unused entry
-// Following the header are "datasize" bytes of user data
+   uint32_t seqno;          // 0xffffffff for an unused entry
+   uint16_t length;         // FLASHLOG_OPT_VARLEN or _LENGTH: the number of bytes of user data
+   uint16_t flags;          // FLASHLOG_FLAG_xxx, and the rest are reserved, 0xffff
+   uint32_t timestamp;      // FLASHLOG_OPT_TIMESTAMP: when the entry was added
+   uint32_t crc; };         // FLASHLOG_OPT_CRC: a CRC-32 of the rest of the entry but the flags
+// Following the header are "datasize" bytes of user data, or "length" bytes
+#define FLASHLOG_ENTRY_SEQNO_SIZE 4
+#define FLASHLOG_HDRSIZE(options) ((options) & FLASHLOG_OPT_CRC ? 16 : (options) & FLASHLOG_OPT_TIMESTAMP ? 12 \
+   : (options) & (FLASHLOG_OPT_VARLEN | FLASHLOG_OPT_LENGTH | FLASHLOG_OPT_COMMIT | FLASHLOG_OPT_COMPRESS) ? 8 : FLASHLOG_ENTRY_SEQNO_SIZE)
+#define FLASHLOG_FLAG_PENDING 0x0001 // FLASHLOG_OPT_COMMIT: cleared once the entry is all written
+#define FLASHLOG_FLAG_COMPRESSED 0x0002 // FLASHLOG_OPT_COMPRESS: cleared if the data is compressed
+#define FLASHLOG_VARLEN_UNIT 4 // variable-length records start on this boundary
+
+// With FLASHLOG_OPT_SUMMARY, this is at the end of each sector once it has been filled.
+// The "type" of an entry is its first byte of data, modulo 32, or 0 if it has no data.
+struct flashlog_summary_t {
+   uint32_t first_seqno, last_seqno; // the entries in the sector
+   uint32_t min_time, max_time;      // FLASHLOG_OPT_TIMESTAMP: their timestamps
+   uint32_t types;                   // bit n is set if there is an entry of type n
+   uint32_t check; };                // so that a partly written summary is ignored
+#define FLASHLOG_SUMMARY_SIZE ((int)sizeof(struct flashlog_summary_t))
+
+#ifdef FLASHLOG_STATS
+// With FLASHLOG_STATS, these are kept for each log from when it is opened. Bucket i of a
+// histogram counts the calls that took from 2^i to 2^(i+1)-1 CPU cycles (on the host, ns).
+// The erase histogram is for the erases of the oldest sector, whether done by an add or
+// by flashlog_maintain.
+#define FLASHLOG_HIST_BUCKETS 32
+struct flashlog_stats_t {
+   uint32_t reads, writes, erases;        // esp_partition_xxx calls
+   uint64_t read_bytes, write_bytes, erase_bytes;
+   uint32_t add_cycles[FLASHLOG_HIST_BUCKETS];   // flashlog_add and flashlog_add_length
+   uint32_t read_cycles[FLASHLOG_HIST_BUCKETS];  // flashlog_read
+   uint32_t erase_cycles[FLASHLOG_HIST_BUCKETS]; };
+#endif
 
 // This is the RAM-resident structure that holds the current state of the log. The
 // caller allocates this as a persistent local or global variable, and passes a pointer to it
@@ -53,12 +107,32 @@ struct flashlog_state_t {
    const esp_partition_t *partition;      // pointer to the ESP32 partition structure for the log
    struct flashlog_entry_hdr_t *entrybuf; // ptr to a buffer that can hold a complete log entry
    void *logdata;                         // ptr to where the user data starts in that buffer
-   int datasize;                          // the size of the user data in each log entry
+   int datasize;                          // the size of the user data in each log entry, or the maximum size
+   int datalen;                           // the size of the user data read by flashlog_read
+   int hdrsize;                           // the size of the entry header in the log
+   int slotsize;                          // the size of a slot: an entry, or FLASHLOG_VARLEN_UNIT
    int numslots;                          // the total number of slots in the log
    uint32_t highest_seqno;                // highest seqno used so far in all the log entries
    int numinuse;                          // how many log slots are currently used, 0..hdr.numslots
    int newest, oldest;                    // newest and oldest slots, 0..numinuse
    int current;                           // currrent slot being read or written, 0..numinuse
+   int nextslot;                          // where the next entry goes, unless it has to start a new sector
+   int nexthint;                          // the next unused open hint in the header sector
+   int options;                           // FLASHLOG_OPT_xxx options given to flashlog_open_options
+   struct flashlog_async_t *async;        // the queue and writer for asynchronous adds, if started
+   struct flashlog_lz_t *lz;              // FLASHLOG_OPT_COMPRESS: the compressor's tables and buffer
+   bool erase_pending;                    // FLASHLOG_OPT_PREERASE: the next sector needs to be erased
+   char *sectorbuf;                       // FLASHLOG_OPT_VARLEN, _CACHE, _SUMMARY, or _COMMIT: a buffer for a sector
+   int cached_sector;                     // the sector in sectorbuf, or -1
+   int torn_sector;                       // FLASHLOG_OPT_COMMIT: a sector to erase before using it, or -1
+   bool entrybuf_given;                   // entrybuf came from flashlog_open_buffer's caller
+   const char *mapped;                    // FLASHLOG_OPT_MMAP: where the partition is mapped, if it is
+   uint32_t map_handle;                   // and the handle for unmapping it
+   uint32_t newest_time;                  // FLASHLOG_OPT_TIMESTAMP: the timestamp of the newest entry
+   struct flashlog_summary_t summary;     // FLASHLOG_OPT_SUMMARY: the sector being filled
+#ifdef FLASHLOG_STATS
+   struct flashlog_stats_t stats;         // operation counts and latency histograms
+#endif
    int partition_err; };                  // the last error from esp_partition_xxx routines
 
 // These are the errors that our functions return. If an error represents
@@ -67,13 +141,18 @@ struct flashlog_state_t {
 enum flashlog_error {
    FLASHLOG_ERR_OK,            // no error
    FLASHLOG_ERR_NO_PARTITION,  // the log FLASH partition wasn't found
-   FLASHLOG_ERR_BADSIZE,       // the log entry datasize is not 4 less than a power of two
+   FLASHLOG_ERR_BADSIZE,       // the log entry datasize is not 4 less than a power of two, or is too big
    FLASHLOG_ERR_READERR,       // can't read log
    FLASHLOG_ERR_NOINIT,        // state not initialized
    FLASHLOG_ERR_WRITEERR,      // can't write log
    FLASHLOG_ERR_ERASEERR,      // can't erase log
    FLASHLOG_ERR_NOMEM,         // memory allocation failure
-   FLASHLOG_ERR_BADSLOT };     // slot wasn't in range 0..numinuse
+   FLASHLOG_ERR_BADSLOT,       // slot wasn't in range 0..numinuse
+   FLASHLOG_ERR_QUEUEFULL,     // the queue for asynchronous adds is full
+   FLASHLOG_ERR_NOMAP,         // the log isn't mapped into memory
+   FLASHLOG_ERR_NOTSUPP,       // that isn't supported with these options
+   FLASHLOG_ERR_CRC,           // the entry is damaged: its CRC doesn't match
+   FLASHLOG_ERR_BADDATA };     // the entry's compressed data can't be decompressed
 
 // Open or initialize a log partition with entries of the specified size,
 // which must be 4 less than a power of 2 and less than 4K, so one of these: 
@@ -86,15 +165,191 @@ enum flashlog_error flashlog_open (
    int datasize,              // the size of the user data in each log entry
    struct flashlog_state_t *state); // where to store the ram-resident state info
 
+// Options for flashlog_open_options, which may be or'ed together.
+#define FLASHLOG_OPT_RTC 0x0001  // keep a copy of the state in RTC memory (see below)
+#define FLASHLOG_OPT_PREERASE 0x0002 // erase the oldest sector early (see flashlog_maintain)
+#define FLASHLOG_OPT_MMAP 0x0004 // map the partition into memory (see flashlog_read_mapped)
+#define FLASHLOG_OPT_CACHE 0x0008 // keep the last sector read in RAM (see flashlog_read)
+#define FLASHLOG_OPT_VARLEN 0x0100 // variable-length records (see below)
+#define FLASHLOG_OPT_LENGTH 0x0200 // fixed-size slots that record how much of them is used (see below)
+#define FLASHLOG_OPT_TIMESTAMP 0x0400 // entries with the time they were added (see below)
+#define FLASHLOG_OPT_SUMMARY 0x0800 // a summary at the end of each sector (see flashlog_query_first)
+#define FLASHLOG_OPT_CRC 0x1000 // entries with a CRC that is checked when they are read (see below)
+#define FLASHLOG_OPT_COMMIT 0x2000 // entries that are ignored unless completely written (see below)
+#define FLASHLOG_OPT_COMPACT 0x4000 // entries without headers, for small ones (see below)
+#define FLASHLOG_OPT_COMPRESS 0x8000 // entries compressed when they are added (see below)
+#define FLASHLOG_OPT_FORMAT 0xff00 // the options that change the format of the log
+
+// Open a log like flashlog_open, but with some of the options above.
+//
+// FLASHLOG_OPT_RTC mirrors the state of the log into RTC slow memory, which survives
+// deep sleep and software resets. The next flashlog_open_options with this option
+// checks the copy against the log with a few small reads and uses it instead of
+// searching the log, which helps devices that wake up often to add an entry.
+// Up to FLASHLOG_RTC_LOGS logs can use this option at once.
+//
+// FLASHLOG_OPT_VARLEN stores each entry with only as many bytes as it has, which are given
+// to flashlog_add_length, instead of in a power-of-two slot. "datasize" is then the maximum
+// size, which can be anything up to 4088, and a log of small and large entries holds many
+// more of them. Records are packed into sectors on 4-byte boundaries and never cross a
+// sector, so the "slots" are 4-byte units and state->numslots counts those. After
+// flashlog_read, state->datalen is the size of the entry that was read.
+//
+// FLASHLOG_OPT_LENGTH keeps the power-of-two slots, but records the length given to
+// flashlog_add_length in an 8-byte entry header, so "datasize" must be 8 less than
+// a power of two: 8, 24, 56, 120, 248, 504, 1016, 2040, or 4088. Only the header and
+// that many bytes are written, and flashlog_read reads only them and sets state->datalen.
+//
+// FLASHLOG_OPT_TIMESTAMP adds a 32-bit timestamp to a 12-byte entry header, which also has
+// the length, as with FLASHLOG_OPT_LENGTH. Without FLASHLOG_OPT_VARLEN, "datasize" must be
+// 12 less than a power of two: 4, 20, 52, 116, 244, 500, 1012, 2036, or 4084. Entries are
+// stamped with time(NULL), or the time given to flashlog_add_time, but never with a time
+// before that of the newest entry, so that the log can be searched by time even if the
+// clock is set back.
+//
+// FLASHLOG_OPT_CRC adds a CRC-32 to a 16-byte entry header, which also has the length and
+// room for a timestamp, so without FLASHLOG_OPT_VARLEN "datasize" must be 16 less than a
+// power of two: 16, 48, 112, 240, 496, 1008, 2032, or 4080. flashlog_read and
+// flashlog_read_mapped return FLASHLOG_ERR_CRC for an entry that doesn't match its CRC,
+// after reading it. flashlog_open checks the newest entry, which is the one that losing
+// power during flashlog_add would damage, and for variable-length records starts the
+// next entry in a new sector if it's bad. (flashlog_read_range doesn't check entries.)
+//
+// FLASHLOG_OPT_COMMIT makes adding an entry safe against losing power. The entry is written
+// with the FLASHLOG_FLAG_PENDING bit of its flags still erased, and then that bit is
+// programmed to 0, so an entry whose write was cut off never looks finished, and
+// flashlog_open ignores it while reading the headers it reads anyway. This uses the
+// flags, so the header is 8 bytes, as for FLASHLOG_OPT_LENGTH, and an add takes a second,
+// small write. The rest of the sector with an unfinished entry is left unused.
+//
+// FLASHLOG_OPT_COMPACT stores only the data of each entry. Each sector starts with the
+// sequence number of its first entry, and the others are numbered by where they are, so
+// with 4-byte entries a sector holds 992 instead of 512 and an add writes half as many
+// bytes. An entry is in use if any of its bytes isn't 0xff; one that is all 0xff is marked
+// in a bitmap of one bit per slot at the end of its sector, which takes a second write.
+// "datasize" can be any multiple of 4 up to 4088. flashlog_read still puts the sequence number in
+// state->entrybuf. It can't be used with the options that need entry headers, which are
+// FLASHLOG_OPT_VARLEN, _LENGTH, _TIMESTAMP, _SUMMARY, _CRC, and _COMMIT, and flashlog_open
+// returns FLASHLOG_ERR_NOTSUPP if they are given, as do flashlog_read_range and
+// flashlog_read_mapped for compact logs.
+//
+// FLASHLOG_OPT_COMPRESS compresses the data of each entry as it is added, with a small
+// LZ77 compressor, and flashlog_read decompresses it, so repetitive text takes fewer bytes
+// of FLASH and fewer bytes are written. The entry header records the compressed length,
+// so it is 8 bytes, as for FLASHLOG_OPT_LENGTH, and only that much is written; with
+// FLASHLOG_OPT_VARLEN the entries also take less room. An entry that doesn't get smaller
+// is stored as it is, and the FLASHLOG_FLAG_COMPRESSED bit of its flags is left set. The
+// compressor uses about 2K bytes of RAM plus a buffer for an entry, and can also find
+// matches in a dictionary given to flashlog_set_dictionary, which helps short entries the
+// most. It can't be used with FLASHLOG_OPT_SUMMARY, and flashlog_read_range and
+// flashlog_read_mapped return FLASHLOG_ERR_NOTSUPP for compressed logs. flashlog_add_many
+// adds the entries one at a time.
+// The format options are recorded in the log, and opening it with different ones
+// reinitializes it.
+enum flashlog_error flashlog_open_options (
+   const char *logname,       // if given, the partition must have this name
+   int datasize,              // the size of the user data in each log entry
+   int options,               // FLASHLOG_OPT_xxx options
+   struct flashlog_state_t *state); // where to store the ram-resident state info
+#define FLASHLOG_RTC_LOGS 2
+
+// Open a log like flashlog_open_options, but use the given buffer for log entries instead
+// of allocating one. It must have room for FLASHLOG_HDRSIZE(options) + datasize bytes,
+// be aligned like a uint32_t, and last until the log is closed. (The FlashLog template
+// in esp32_flashlogs_typed.h uses this to keep the buffer in the object.)
+enum flashlog_error flashlog_open_buffer (
+   const char *logname,       // if given, the partition must have this name
+   int datasize,              // the size of the user data in each log entry
+   int options,               // FLASHLOG_OPT_xxx options
+   struct flashlog_state_t *state, // where to store the ram-resident state info
+   void *entrybuf);           // the buffer for a log entry with its header
+
+// With FLASHLOG_OPT_PREERASE, the sector after the one that has the newest entry is kept
+// erased, so that adding an entry never has to wait for an erase. That sector's entries
+// are deleted one sector earlier than they would otherwise be. Call flashlog_maintain
+// when there is time to spare, for example in an idle loop, to do the erase once an
+// add has started a new sector; if it hasn't been called by the time the erased sector
+// is needed, the add will do the erase. The writer task for asynchronous adds doesn't
+// call it, so that the oldest entries aren't deleted while nothing is being added.
+enum flashlog_error flashlog_maintain(struct flashlog_state_t *state);
+
 // Add a new log entry using the data you put at state->logdata.
 // Be careful to put no more than "datasize" bytes there!
 enum flashlog_error flashlog_add (struct flashlog_state_t *state);
 
+// Add a new log entry using the first "length" bytes of the data at state->logdata.
+// With FLASHLOG_OPT_VARLEN or FLASHLOG_OPT_LENGTH only those bytes are written;
+// otherwise this is like flashlog_add.
+enum flashlog_error flashlog_add_length (struct flashlog_state_t *state, int length);
+
+// Add a new log entry like flashlog_add_length, but with FLASHLOG_OPT_TIMESTAMP use the given
+// timestamp instead of time(NULL). It can be in whatever units you like, as long as they fit
+// in 32 bits and are the same ones you give to flashlog_goto_time.
+enum flashlog_error flashlog_add_time (struct flashlog_state_t *state, int length, uint32_t timestamp);
+
+// Add "count" new log entries whose data, "datasize" bytes each, is consecutive at "entries".
+// They get consecutive sequence numbers, and the entries that fit in the same 4K sector
+// are written together, which is much faster than adding them one at a time.
+enum flashlog_error flashlog_add_many (struct flashlog_state_t *state, const void *entries, int count);
+
+// Add a new log entry that will become printf-style text when it's read, but without
+// formatting it now. The entry is a 32-bit ID of the format string, the FNV-1a hash that
+// flashlog_format_id returns, followed by the arguments in binary: 4 bytes for each number,
+// char, and pointer, but 8 for a double and for "ll" and "j" integers, and a length byte
+// and the characters for a string. ("l" integers are 4 bytes, as they are on the ESP32.)
+// Strings are cut short to fit in "datasize"; if the rest doesn't fit either, this returns
+// FLASHLOG_ERR_BADSIZE. A conversion this doesn't know, like "%q" or "%S", makes it
+// return FLASHLOG_ERR_NOTSUPP without adding anything. Only the bytes used are written if the
+// log has lengths. Use it with the format strings themselves, not with text made at run
+// time, so that something that knows them, like host/flashlog_decode.cpp, can turn the
+// entries back into text.
+enum flashlog_error flashlog_logf (struct flashlog_state_t *state, const char *format, ...)
+   __attribute__((format(printf, 2, 3)));
+uint32_t flashlog_format_id (const char *format);
+
+// Make the text of an entry added by flashlog_logf with "format", from its "length" bytes at
+// "data", into "buf", which has room for "size" characters, like snprintf. It returns the
+// length of the whole text, or -1 if the entry isn't one made with that format.
+int flashlog_format_entry (const char *format, const void *data, int length, char *buf, int size);
+
+// With FLASHLOG_OPT_COMPRESS, use "length" bytes at "dictionary" as text that entries are
+// likely to repeat, like some typical entries, to compress them better. The dictionary isn't
+// copied or stored in the log, so it must last until the log is closed, and the same one
+// must be given every time the log is opened, before anything is added or read. It can be
+// up to FLASHLOG_DICT_MAX bytes, and a length of 0 stops using one.
+enum flashlog_error flashlog_set_dictionary (struct flashlog_state_t *state, const void *dictionary, int length);
+#define FLASHLOG_DICT_MAX 32768
+
 // Read a log entry's data into state->logdata.
 // The log entry is identified by "slot number" state->current,
 // which should have been set by one of the flashlog_goto_xxx calls.
+// state->datalen is set to the number of bytes of data that were read.
+// With FLASHLOG_OPT_CACHE, reading an entry reads its whole 4K sector into a buffer
+// allocated when the log is opened, and reads of the other entries in the same sector,
+// going in either direction, are served from there. The cache is kept up to date as
+// entries are added and sectors are erased.
 enum flashlog_error flashlog_read (struct flashlog_state_t *state);
 
+// Read a range of entries, for exporting the log, with one esp_partition_read, or two if the
+// range wraps around the end of the partition. Up to "max_entries" entries, starting with
+// sequence number "start_seqno" (or the oldest if that has been deleted), are copied to
+// "buf", which must have room for that many complete slots of FLASHLOG_HDRSIZE(options) +
+// datasize bytes, headers and all. *count is set to how many were read, and *next_seqno
+// to the sequence number to start with next time. When there are no more, *count is 0.
+// This isn't supported for FLASHLOG_OPT_VARLEN, _SUMMARY, _COMMIT, _COMPACT, or _COMPRESS logs.
+enum flashlog_error flashlog_read_range (struct flashlog_state_t *state, uint32_t start_seqno, int max_entries,
+      void *buf, int *count, uint32_t *next_seqno);
+
+// With FLASHLOG_OPT_MMAP, the whole partition is mapped into the data address space when the
+// log is opened, and all reads go through the FLASH cache instead of being separate SPI
+// transactions. flashlog_read_mapped then sets *entry to point at the header of log entry
+// state->current where it is mapped, without copying anything; the data follows the header,
+// FLASHLOG_HDRSIZE(options) bytes in, and state->datalen is set to its size. The pointer is
+// good until the sector is erased, so don't hold on to it while entries are being added.
+// The ESP32 can map only a few megabytes of data; if the mapping fails, the log works as if
+// the option weren't given, and flashlog_read_mapped returns FLASHLOG_ERR_NOMAP.
+enum flashlog_error flashlog_read_mapped (struct flashlog_state_t *state, const struct flashlog_entry_hdr_t **entry);
+
 // Navigate to the oldest/newest/next/previous log entry before
 // calling flashlog_read(). If there is no such entry, it
 // returns FLASHLOG_ERR_BADSLOT instead of FLASHLOG_ERR_OK.
@@ -103,6 +358,67 @@ enum flashlog_error flashlog_goto_newest(struct flashlog_state_t *);
 enum flashlog_error flashlog_goto_next(struct flashlog_state_t *);
 enum flashlog_error flashlog_goto_prev(struct flashlog_state_t *);
 
+// Navigate to the log entry with the given sequence number, which is the entry's
+// state->entrybuf->seqno after it is read. If it has been deleted or hasn't been
+// added yet, this returns FLASHLOG_ERR_BADSLOT. In a log of fixed-size entries this
+// takes one small FLASH read; with FLASHLOG_OPT_VARLEN, it does a binary search of
+// the sectors and then reads one sector.
+enum flashlog_error flashlog_goto_seqno(struct flashlog_state_t *, uint32_t seqno);
+
+// With FLASHLOG_OPT_TIMESTAMP, navigate to the oldest log entry whose timestamp is at least
+// "t", with a binary search that reads a few entry headers and then one sector. It returns
+// FLASHLOG_ERR_BADSLOT if all the entries are older. To read the entries from "start" to
+// "end", go to "start" and read forward until state->entrybuf->timestamp is after "end":
+//    if (flashlog_goto_time(&state, start) == FLASHLOG_ERR_OK)
+//       while (flashlog_read(&state) == FLASHLOG_ERR_OK && state.entrybuf->timestamp <= end) {
+//          ...
+//          if (flashlog_goto_next(&state) != FLASHLOG_ERR_OK) break; }
+enum flashlog_error flashlog_goto_time(struct flashlog_state_t *, uint32_t t);
+
+// Queries. With FLASHLOG_OPT_SUMMARY, the last FLASHLOG_SUMMARY_SIZE bytes of each sector
+// are reserved for a summary of its entries, which is written when the sector is full.
+// (For fixed-size entries, that costs as many slots as the summary needs, so it suits small
+// entries. With FLASHLOG_OPT_VARLEN, the header and "datasize" bytes must fit before the
+// summary, so "datasize" can be at most 4064 with an 8-byte header, and flashlog_open
+// returns FLASHLOG_ERR_BADSIZE otherwise.) flashlog_query_first and flashlog_query_next
+// navigate to the oldest entry, or the next one after state->current, that matches all the
+// conditions of a query, and return FLASHLOG_ERR_BADSLOT if there isn't one. They read only the summary of a sector that
+// can't have any matching entries, so a query that matches a small part of a big log is
+// much faster than reading the log. The types are those of struct flashlog_summary_t.
+struct flashlog_query_t {
+   uint32_t first_seqno, last_seqno; // the range of sequence numbers
+   uint32_t start_time, end_time;    // with FLASHLOG_OPT_TIMESTAMP, the range of timestamps
+   uint32_t types; };                // bit n to match entries of type n
+#define FLASHLOG_QUERY_ALL {0, UINT32_MAX, 0, UINT32_MAX, UINT32_MAX} // matches everything
+enum flashlog_error flashlog_query_first(struct flashlog_state_t *state, const struct flashlog_query_t *query);
+enum flashlog_error flashlog_query_next(struct flashlog_state_t *state, const struct flashlog_query_t *query);
+
+// Asynchronous adds, which don't make the caller wait for the FLASH to be written.
+// flashlog_async_start creates a queue for "queuesize" entries, and a task that writes
+// queued entries to the log in the background. (On the ESP32 this is a FreeRTOS task,
+// which is pinned to the given core unless "core" is -1; elsewhere it is a thread.)
+// flashlog_add_async then copies the entry at state->logdata into the queue and returns
+// immediately, or returns FLASHLOG_ERR_QUEUEFULL if there is no room.
+// flashlog_flush waits until everything queued has been written, and returns the first
+// error the writer got, if any. flashlog_async_stop flushes the queue and stops the writer,
+// and is done by flashlog_close. The other functions may be used while the writer is
+// running; flashlog_add first waits for the queue to be written, to keep entries in order.
+// Like any add, a queued entry that starts a sector erases the oldest one if it has to,
+// so call flashlog_flush before reading entries near the oldest if entries are queued.
+enum flashlog_error flashlog_async_start(struct flashlog_state_t *state, int queuesize, int core);
+enum flashlog_error flashlog_add_async(struct flashlog_state_t *state);
+enum flashlog_error flashlog_flush(struct flashlog_state_t *state);
+int flashlog_queue_depth(struct flashlog_state_t *state); // how many entries are queued
+enum flashlog_error flashlog_async_stop(struct flashlog_state_t *state);
+#define FLASHLOG_TASK_STACK 4096    // the stack size of the writer task
+#define FLASHLOG_TASK_PRIORITY 1    // and its FreeRTOS priority
+
+#ifdef FLASHLOG_STATS
+// Get a copy of the statistics for the log, or reset them to zero.
+enum flashlog_error flashlog_get_stats(struct flashlog_state_t *state, struct flashlog_stats_t *stats);
+enum flashlog_error flashlog_reset_stats(struct flashlog_state_t *state);
+#endif
+
 // Close the log and free the buffer that had been allocated for it.
 enum flashlog_error flashlog_close(struct flashlog_state_t *state);
 
@@ -0,0 +1,155 @@
+/* file: esp32_flashlogs_typed.h
+   ------------------------------------------------------------------------------------
+   A typed front end for esp32_flashlogs, for those who like C++ more than I do.
+
+   FlashLog<T> is a log whose entries are a struct or other trivially-copyable type T.
+   The slot size is picked at compile time as the smallest power of two that holds T
+   and the entry header, and the entry buffer is part of the object, so nothing is
+   allocated to hold entries. Everything compiles down to the flashlog_xxx calls.
+
+      struct event_t { uint32_t time; int16_t code, value; };
+      FlashLog<event_t> events;
+      events.open();            // or events.open("log1", FLASHLOG_OPT_RTC)
+      events.add(event_t{...});
+      for (event_t e : events)  // oldest to newest
+         ...
+      for (event_t e : events.newest_first())
+         ...
+      for (event_t e : events.between(t1, t2)) // with FLASHLOG_OPT_TIMESTAMP
+         ...
+
+   Iterating moves the log's current slot, so don't add entries from another task
+   while a loop is reading them. The iterators keep a copy of the entry they are on, so
+   T must also be default-constructible to use them. A FlashLog can't be copied, because
+   the log's state points into the object's own entry buffer.
+   -----------------------------------------------------------------------------------*/
+/* Copyright(c) 2021, Len Shustek
+   The MIT License(MIT)
+   Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+   and associated documentation files(the "Software"), to deal in the Software without
+   restriction, including without limitation the rights to use, copy, modify, merge, publish,
+   distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions :
+
+   The above copyright notice and this permission notice shall be included in all copies or
+   substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+   BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+   DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#ifndef ESP32_FLASHLOGS_TYPED_H
+#define ESP32_FLASHLOGS_TYPED_H
+
+#include <string.h>
+#include <type_traits>
+#include "esp32_flashlogs.h"
+
+// the smallest power of two that is at least n
+constexpr int flashlog_slot_for(int n, int slot = 1) {
+   return slot >= n ? slot : flashlog_slot_for(n, slot * 2); }
+
+// OPTIONS are the FLASHLOG_OPT_xxx options, except for FLASHLOG_OPT_VARLEN
+template <typename T, int OPTIONS = 0>
+class FlashLog {
+public:
+   static constexpr int hdrsize = FLASHLOG_HDRSIZE(OPTIONS);
+   static constexpr int slotsize = flashlog_slot_for((int)sizeof(T) + hdrsize);
+   static constexpr int datasize = (OPTIONS & FLASHLOG_OPT_COMPACT) ? ((int)sizeof(T) + 3) & ~3 // no power of two needed
+                                   : slotsize - hdrsize; // what the log is opened with
+   static_assert(slotsize <= FLASHLOG_SECTOR, "the entry type is too big for a log slot");
+   static_assert(!(OPTIONS & FLASHLOG_OPT_VARLEN), "FlashLog uses fixed-size slots");
+   static_assert(std::is_trivially_copyable<T>::value, "log entries are copied as bytes");
+
+   FlashLog() = default;
+   FlashLog(const FlashLog &) = delete; // the state would point into the other one's buffer
+   FlashLog &operator=(const FlashLog &) = delete;
+
+   // Open the log. The format options always come from OPTIONS. Because the datasize is
+   // picked from sizeof(T), changing T so that it needs a different slot size reinitializes
+   // the log, as flashlog_open would.
+   enum flashlog_error open(const char *logname = NULL, int options = OPTIONS) {
+      return flashlog_open_buffer(logname, datasize, (options & ~FLASHLOG_OPT_FORMAT) | (OPTIONS & FLASHLOG_OPT_FORMAT),
+                                  &state, entrybuf); }
+   enum flashlog_error close() {
+      return flashlog_close(&state); }
+
+   enum flashlog_error add(const T &entry) {
+      memcpy(state.logdata, &entry, sizeof(T));
+      return (OPTIONS & FLASHLOG_OPT_LENGTH) ? flashlog_add_length(&state, sizeof(T)) : flashlog_add(&state); }
+   enum flashlog_error add(const T &entry, uint32_t timestamp) { // with FLASHLOG_OPT_TIMESTAMP
+      memcpy(state.logdata, &entry, sizeof(T));
+      return flashlog_add_time(&state, sizeof(T), timestamp); }
+   enum flashlog_error add_many(const T *entries, int count) { // only if T is exactly datasize bytes
+      static_assert(sizeof(T) == datasize, "add_many needs entries that fill the slots");
+      return flashlog_add_many(&state, entries, count); }
+
+   // read the entry at the current slot
+   enum flashlog_error read(T *entry) {
+      enum flashlog_error err = flashlog_read(&state);
+      if (err == FLASHLOG_ERR_OK)
+         memcpy((void *)entry, state.logdata, sizeof(T));
+      return err; }
+   enum flashlog_error goto_oldest() { return flashlog_goto_oldest(&state); }
+   enum flashlog_error goto_newest() { return flashlog_goto_newest(&state); }
+   enum flashlog_error goto_next() { return flashlog_goto_next(&state); }
+   enum flashlog_error goto_prev() { return flashlog_goto_prev(&state); }
+   enum flashlog_error goto_seqno(uint32_t seqno) { return flashlog_goto_seqno(&state, seqno); }
+   enum flashlog_error goto_time(uint32_t t) { return flashlog_goto_time(&state, t); }
+   uint32_t timestamp() const { return state.entrybuf->timestamp; } // of the entry last read
+   int count() const { return state.numinuse; }
+
+   // An input iterator over the entries, in either direction. It stops early
+   // if an entry can't be read. Going forward from a time, it stops after "end".
+   class iterator {
+      static_assert(std::is_default_constructible<T>::value, "iterating needs a T to read entries into");
+   public:
+      iterator(FlashLog *log, bool forward, bool done) : log(log), forward(forward), done(done), end(UINT32_MAX) {
+         if (!done) {
+            this->done = (forward ? log->goto_oldest() : log->goto_newest()) != FLASHLOG_ERR_OK;
+            fetch(); } }
+      iterator(FlashLog *log, uint32_t start, uint32_t end) : log(log), forward(true), end(end) {
+         done = log->goto_time(start) != FLASHLOG_ERR_OK;
+         fetch(); }
+      const T &operator*() const { return entry; }
+      const T *operator->() const { return &entry; }
+      iterator &operator++() {
+         done = (forward ? log->goto_next() : log->goto_prev()) != FLASHLOG_ERR_OK;
+         fetch();
+         return *this; }
+      bool operator!=(const iterator &other) const { return done != other.done; }
+      bool operator==(const iterator &other) const { return done == other.done; }
+   private:
+      void fetch() {
+         if (!done) done = log->read(&entry) != FLASHLOG_ERR_OK || (end != UINT32_MAX && log->timestamp() > end); }
+      FlashLog *log;
+      bool forward, done;
+      uint32_t end;
+      T entry; };
+
+   iterator begin() { return iterator(this, true, false); }
+   iterator end() { return iterator(this, true, true); }
+
+   // for (T e : log.newest_first())
+   struct reversed {
+      FlashLog *log;
+      iterator begin() { return iterator(log, false, false); }
+      iterator end() { return iterator(log, false, true); } };
+   reversed newest_first() { return reversed{this}; }
+
+   // for (T e : log.between(start, end)), the entries with timestamps from "start" to "end"
+   struct timespan {
+      FlashLog *log;
+      uint32_t from, to;
+      iterator begin() { return iterator(log, from, to); }
+      iterator end() { return iterator(log, true, true); } };
+   timespan between(uint32_t start, uint32_t end) { return timespan{this, start, end}; }
+
+   struct flashlog_state_t state = {}; // for anything the template doesn't cover
+
+private:
+   alignas(uint32_t) char entrybuf[slotsize]; };
+
+#endif
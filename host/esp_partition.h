@@ -0,0 +1,137 @@
+/* file: host/esp_partition.h
+   ------------------------------------------------------------------------------------
+   A stand-in for the ESP-IDF partition API, so that esp32_flashlogs.cpp can be
+   compiled and run on Linux. Compile with -Ihost ahead of any ESP-IDF include
+   directories, and link with host/esp_partition_host.cpp.
+
+   The partitions are emulated NOR flash, kept in RAM or in a file that is mapped
+   into memory. Like the real thing, programming can only change 1-bits to 0-bits,
+   erasing sets a whole 4K sector to 0xFF, and never-written memory reads as 0xFF.
+   Every operation is counted, so tests and benchmarks can see what the log did.
+   -----------------------------------------------------------------------------------*/
+/* Copyright(c) 2021, Len Shustek
+   The MIT License(MIT)
+   Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+   and associated documentation files(the "Software"), to deal in the Software without
+   restriction, including without limitation the rights to use, copy, modify, merge, publish,
+   distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions :
+
+   The above copyright notice and this permission notice shall be included in all copies or
+   substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+   BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+   DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#ifndef ESP_PARTITION_H_HOST
+#define ESP_PARTITION_H_HOST
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+// the parts of the ESP-IDF types and error codes that we need
+typedef int esp_err_t;
+#define ESP_OK                  0
+#define ESP_FAIL                -1
+#define ESP_ERR_NO_MEM          0x101
+#define ESP_ERR_INVALID_ARG     0x102
+#define ESP_ERR_INVALID_STATE   0x103
+#define ESP_ERR_INVALID_SIZE    0x104
+#define ESP_ERR_NOT_FOUND       0x105
+
+typedef int esp_partition_type_t;
+typedef int esp_partition_subtype_t;
+#define ESP_PARTITION_SUBTYPE_ANY (esp_partition_subtype_t)0xff
+
+typedef struct {
+   esp_partition_type_t type;
+   esp_partition_subtype_t subtype;
+   uint32_t address;        // where it would be in the FLASH memory
+   uint32_t size;
+   uint32_t erase_size;     // always 4096
+   char label[17];
+   bool encrypted; } esp_partition_t;
+
+// the ESP-IDF partition functions that esp32_flashlogs uses
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label);
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t src_offset, void *dst, size_t size);
+esp_err_t esp_partition_write(const esp_partition_t *partition, size_t dst_offset, const void *src, size_t size);
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size);
+typedef enum { ESP_PARTITION_MMAP_DATA, ESP_PARTITION_MMAP_INST } esp_partition_mmap_memory_t;
+typedef uint32_t esp_partition_mmap_handle_t;
+esp_err_t esp_partition_mmap(const esp_partition_t *partition, size_t offset, size_t size,
+      esp_partition_mmap_memory_t memory, const void **out_ptr, esp_partition_mmap_handle_t *out_handle);
+void esp_partition_munmap(esp_partition_mmap_handle_t handle);
+
+// Create an emulated partition. If "filename" is given, the partition is kept in that file,
+// which is created or extended with erased memory as needed, so the log survives from one
+// run to the next. Otherwise it is in RAM and starts out erased. The size must be a multiple
+// of 4K. Returns NULL if it can't be created.
+const esp_partition_t *flashhost_add_partition(const char *label, esp_partition_type_t type,
+      esp_partition_subtype_t subtype, uint32_t size, const char *filename);
+
+// remove all the emulated partitions, writing back any that are in files
+void flashhost_remove_all(void);
+
+// the emulated FLASH memory of a partition, for tests that want to look at it or damage it
+uint8_t *flashhost_memory(const esp_partition_t *partition);
+
+// The operation counts for a partition. A write that tries to change a 0-bit to a 1-bit is a
+// "NOR violation". In strict mode, which is the default, it fails with ESP_ERR_INVALID_STATE
+// and nothing is written; otherwise the bits are and'ed in, which is what the hardware does.
+struct flashhost_counts_t {
+   long reads, writes, erases;             // the number of calls
+   long long read_bytes, write_bytes, erase_bytes;
+   long nor_violations; };
+void flashhost_get_counts(const esp_partition_t *partition, struct flashhost_counts_t *counts);
+void flashhost_reset_counts(const esp_partition_t *partition);
+void flashhost_set_strict(bool strict);
+
+// Simulate losing power after the next "bytes" bytes have been written. The write that
+// crosses that point programs the bytes before it, half programs the one at it, and fails,
+// and after that all reads, writes, and erases fail until the power is turned back on by
+// calling this with -1, which is also the default.
+void flashhost_set_powercut(long bytes);
+bool flashhost_power_failed(void);
+
+// The number of esp_partition_mmap calls that have not been unmapped, so tests can check for leaks.
+int flashhost_mappings(void);
+
+// The cost model, for predicting how long things take on the device. Each partition
+// operation advances a virtual clock by what it would cost there: a fixed overhead per
+// call, plus the SPI transfer time for reads, the program time for each 256-byte page
+// a write touches, or the erase time for each block, using 64K and 32K block erases
+// where the range is aligned for them, as spi_flash_erase_range does. Reads through
+// esp_partition_mmap are memory accesses, which the model doesn't charge for. The defaults are
+// typical for the 4MB parts on ESP32 modules; the time spent in the log code itself
+// isn't counted, since on the host it says nothing about the device.
+struct flashhost_cost_t {
+   double call_us;          // the overhead of each esp_partition_xxx call
+   double read_mbps;        // the SPI read bandwidth, in megabytes per second
+   double write_mbps;       // the SPI bandwidth for sending data to be programmed
+   double program_us;       // the time to program a page
+   double erase4k_us, erase32k_us, erase64k_us; }; // the time to erase a 4K sector and 32K and 64K blocks
+#define FLASHHOST_PAGE 256
+void flashhost_get_cost(struct flashhost_cost_t *cost);
+void flashhost_set_cost(const struct flashhost_cost_t *cost);
+double flashhost_clock_us(void); // the virtual clock, in microseconds
+
+// Recording the predicted time of calls. FLASHHOST_TIMED("flashlog_add", err = flashlog_add(&state))
+// does the call and records how far it moved the virtual clock under that name.
+// flashhost_report prints the count, mean, p50, p99, and maximum for each name.
+#define FLASHHOST_TIMED(name, call) do { double start_us_ = flashhost_clock_us(); call; \
+   flashhost_record(name, flashhost_clock_us() - start_us_); } while (0)
+void flashhost_record(const char *name, double us);
+struct flashhost_stats_t {
+   long count;
+   double mean_us, p50_us, p99_us, max_us, total_us; };
+bool flashhost_get_stats(const char *name, struct flashhost_stats_t *stats); // false if never recorded
+void flashhost_report(FILE *out);
+void flashhost_reset_records(void);
+
+#endif
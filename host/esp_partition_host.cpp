@@ -0,0 +1,340 @@
+/* file: host/esp_partition_host.cpp
+   ------------------------------------------------------------------------------------
+   The emulated NOR FLASH partitions for building esp32_flashlogs on Linux.
+   See host/esp_partition.h.
+   -----------------------------------------------------------------------------------*/
+/* Copyright(c) 2021, Len Shustek
+   The MIT License(MIT)
+   Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+   and associated documentation files(the "Software"), to deal in the Software without
+   restriction, including without limitation the rights to use, copy, modify, merge, publish,
+   distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions :
+
+   The above copyright notice and this permission notice shall be included in all copies or
+   substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+   BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+   DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "esp_partition.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define FLASHHOST_SECTOR 4096
+#define FLASHHOST_MAXPARTS 8
+#define FLASHHOST_BASE 0x110000 // the FLASH address of the first partition
+
+// an emulated partition: the ESP-IDF structure, its memory, and its counts
+struct flashhost_part_t {
+   esp_partition_t partition;
+   uint8_t *mem;
+   int fd;                           // the file it's mapped from, or -1 if it's in RAM
+   struct flashhost_counts_t counts; };
+
+static struct flashhost_part_t parts[FLASHHOST_MAXPARTS];
+static int numparts = 0;
+static bool strict = true;
+static long powercut = -1;  // the bytes that can still be written before the power fails, or -1
+static bool poweroff = false;
+
+static struct flashhost_cost_t cost = {
+   20,                      // call_us: mostly disabling and restoring the cache
+   16,                      // read_mbps: 40 MHz DIO, less command overhead
+   8,                       // write_mbps: writes go out in single-bit mode
+   400,                     // program_us
+   45000, 120000, 150000 }; // erase4k_us, erase32k_us, erase64k_us
+static double clock_us = 0;
+static int mappings = 0;
+
+static struct flashhost_part_t *
+find_part (const esp_partition_t *partition) {
+   for (int i = 0; i < numparts; ++i)
+      if (&parts[i].partition == partition)
+         return &parts[i];
+   return NULL; }
+
+const esp_partition_t *
+flashhost_add_partition (const char *label, esp_partition_type_t type, esp_partition_subtype_t subtype,
+                         uint32_t size, const char *filename) {
+   if (numparts >= FLASHHOST_MAXPARTS || size == 0 || size % FLASHHOST_SECTOR != 0
+         || strlen(label) >= sizeof(parts[0].partition.label))
+      return NULL;
+   struct flashhost_part_t *part = &parts[numparts];
+   part->fd = -1;
+   if (filename) { // map the file, extending it with erased memory if it's too short
+      struct stat st;
+      if ((part->fd = open(filename, O_RDWR | O_CREAT, 0644)) < 0)
+         return NULL;
+      if (fstat(part->fd, &st) != 0
+            || ((uint32_t)st.st_size < size && ftruncate(part->fd, size) != 0)
+            || (part->mem = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, part->fd, 0)) == MAP_FAILED) {
+         close(part->fd);
+         return NULL; }
+      if ((uint32_t)st.st_size < size)
+         memset(part->mem + st.st_size, 0xff, size - st.st_size); }
+   else {
+      if (!(part->mem = (uint8_t *)malloc(size)))
+         return NULL;
+      memset(part->mem, 0xff, size); }
+   esp_partition_t *p = &part->partition;
+   p->type = type;
+   p->subtype = subtype;
+   p->address = numparts == 0 ? FLASHHOST_BASE : parts[numparts - 1].partition.address + parts[numparts - 1].partition.size;
+   p->size = size;
+   p->erase_size = FLASHHOST_SECTOR;
+   strcpy(p->label, label);
+   p->encrypted = false;
+   memset(&part->counts, 0, sizeof(part->counts));
+   ++numparts;
+   return p; }
+
+void
+flashhost_remove_all (void) {
+   for (int i = 0; i < numparts; ++i) {
+      struct flashhost_part_t *part = &parts[i];
+      if (part->fd >= 0) {
+         munmap(part->mem, part->partition.size);
+         close(part->fd); }
+      else free(part->mem); }
+   numparts = 0; }
+
+uint8_t *
+flashhost_memory (const esp_partition_t *partition) {
+   struct flashhost_part_t *part = find_part(partition);
+   return part ? part->mem : NULL; }
+
+void
+flashhost_get_counts (const esp_partition_t *partition, struct flashhost_counts_t *counts) {
+   struct flashhost_part_t *part = find_part(partition);
+   if (part) *counts = part->counts;
+   else memset(counts, 0, sizeof(*counts)); }
+
+void
+flashhost_reset_counts (const esp_partition_t *partition) {
+   struct flashhost_part_t *part = find_part(partition);
+   if (part) memset(&part->counts, 0, sizeof(part->counts)); }
+
+void
+flashhost_set_strict (bool on) {
+   strict = on; }
+
+void
+flashhost_set_powercut (long bytes) {
+   powercut = bytes;
+   poweroff = false; }
+
+bool
+flashhost_power_failed (void) {
+   return poweroff; }
+
+void
+flashhost_get_cost (struct flashhost_cost_t *c) {
+   *c = cost; }
+
+void
+flashhost_set_cost (const struct flashhost_cost_t *c) {
+   cost = *c; }
+
+double
+flashhost_clock_us (void) {
+   return clock_us; }
+
+// the time to write "size" bytes at a FLASH address, which is programmed a page at a time
+static double
+write_cost (uint32_t address, size_t size) {
+   if (size == 0) return cost.call_us;
+   size_t pages = (address + size - 1) / FLASHHOST_PAGE - address / FLASHHOST_PAGE + 1;
+   return cost.call_us + size / cost.write_mbps + pages * cost.program_us; }
+
+// the time to erase a range, using the biggest aligned blocks that fit
+static double
+erase_cost (uint32_t address, size_t size) {
+   double us = cost.call_us;
+   while (size > 0) {
+      size_t block;
+      if (address % 65536 == 0 && size >= 65536) block = 65536, us += cost.erase64k_us;
+      else if (address % 32768 == 0 && size >= 32768) block = 32768, us += cost.erase32k_us;
+      else block = FLASHHOST_SECTOR, us += cost.erase4k_us;
+      address += block;
+      size -= block; }
+   return us; }
+
+// The recorded times, by name. There are only ever a few names, so a list will do.
+#define FLASHHOST_MAXNAMES 32
+static struct {
+   const char *name;
+   double *times;
+   long count, room; } records[FLASHHOST_MAXNAMES];
+static int numnames = 0;
+
+void
+flashhost_record (const char *name, double us) {
+   int i;
+   for (i = 0; i < numnames && strcmp(records[i].name, name) != 0; ++i) ;
+   if (i == numnames) {
+      if (numnames >= FLASHHOST_MAXNAMES) return;
+      records[numnames].name = name;
+      records[numnames].times = NULL;
+      records[numnames].count = records[numnames].room = 0;
+      ++numnames; }
+   if (records[i].count >= records[i].room) {
+      long room = records[i].room ? 2 * records[i].room : 1024;
+      double *times = (double *)realloc(records[i].times, room * sizeof(double));
+      if (!times) return;
+      records[i].times = times;
+      records[i].room = room; }
+   records[i].times[records[i].count++] = us; }
+
+static int
+compare_times (const void *a, const void *b) {
+   double x = *(const double *)a, y = *(const double *)b;
+   return x < y ? -1 : x > y; }
+
+// the time that "pct" percent of the sorted times are at or below
+static double
+percentile (const double *times, long count, double pct) {
+   long i = (long)(pct / 100 * count + 0.999999) - 1;
+   return times[i < 0 ? 0 : i >= count ? count - 1 : i]; }
+
+bool
+flashhost_get_stats (const char *name, struct flashhost_stats_t *stats) {
+   memset(stats, 0, sizeof(*stats));
+   for (int i = 0; i < numnames; ++i)
+      if (strcmp(records[i].name, name) == 0 && records[i].count > 0) {
+         long count = records[i].count;
+         qsort(records[i].times, count, sizeof(double), compare_times);
+         for (long j = 0; j < count; ++j)
+            stats->total_us += records[i].times[j];
+         stats->count = count;
+         stats->mean_us = stats->total_us / count;
+         stats->p50_us = percentile(records[i].times, count, 50);
+         stats->p99_us = percentile(records[i].times, count, 99);
+         stats->max_us = records[i].times[count - 1];
+         return true; }
+   return false; }
+
+void
+flashhost_report (FILE *out) {
+   struct flashhost_stats_t st;
+   fprintf(out, "%-24s %8s %12s %12s %12s %12s\n", "predicted device time", "calls", "mean us", "p50 us", "p99 us", "max us");
+   for (int i = 0; i < numnames; ++i)
+      if (flashhost_get_stats(records[i].name, &st))
+         fprintf(out, "%-24s %8ld %12.1f %12.1f %12.1f %12.1f\n", records[i].name, st.count,
+                 st.mean_us, st.p50_us, st.p99_us, st.max_us); }
+
+void
+flashhost_reset_records (void) {
+   for (int i = 0; i < numnames; ++i)
+      free(records[i].times);
+   numnames = 0; }
+
+const esp_partition_t *
+esp_partition_find_first (esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label) {
+   for (int i = 0; i < numparts; ++i) {
+      esp_partition_t *p = &parts[i].partition;
+      if (p->type == type
+            && (subtype == ESP_PARTITION_SUBTYPE_ANY || p->subtype == subtype)
+            && (!label || strcmp(p->label, label) == 0))
+         return p; }
+   return NULL; }
+
+esp_err_t
+esp_partition_read (const esp_partition_t *partition, size_t src_offset, void *dst, size_t size) {
+   struct flashhost_part_t *part = find_part(partition);
+   if (!part || !dst)
+      return ESP_ERR_INVALID_ARG;
+   if (src_offset > partition->size || size > partition->size - src_offset)
+      return ESP_ERR_INVALID_SIZE;
+   if (poweroff)
+      return ESP_FAIL;
+   memcpy(dst, part->mem + src_offset, size);
+   clock_us += cost.call_us + size / cost.read_mbps;
+   ++part->counts.reads;
+   part->counts.read_bytes += size;
+   return ESP_OK; }
+
+esp_err_t
+esp_partition_write (const esp_partition_t *partition, size_t dst_offset, const void *src, size_t size) {
+   struct flashhost_part_t *part = find_part(partition);
+   if (!part || !src)
+      return ESP_ERR_INVALID_ARG;
+   if (dst_offset > partition->size || size > partition->size - dst_offset)
+      return ESP_ERR_INVALID_SIZE;
+   if (poweroff)
+      return ESP_FAIL;
+   const uint8_t *data = (const uint8_t *)src;
+   uint8_t *mem = part->mem + dst_offset;
+   long violations = 0;
+   for (size_t i = 0; i < size; ++i)
+      if ((mem[i] & data[i]) != data[i])
+         ++violations;
+   part->counts.nor_violations += violations;
+   if (violations && strict) {
+      fprintf(stderr, "flashhost: write to %s at 0x%zx would set %ld bytes' bits from 0 to 1\n",
+              partition->label, dst_offset, violations);
+      return ESP_ERR_INVALID_STATE; }
+   if (powercut >= 0 && (size_t)powercut < size) { // the power fails part way through
+      for (long i = 0; i < powercut; ++i)
+         mem[i] &= data[i];
+      mem[powercut] &= data[powercut] | 0x0f;
+      clock_us += write_cost(partition->address + dst_offset, powercut + 1);
+      poweroff = true;
+      return ESP_FAIL; }
+   if (powercut >= 0)
+      powercut -= size;
+   for (size_t i = 0; i < size; ++i) // programming can only clear bits
+      mem[i] &= data[i];
+   clock_us += write_cost(partition->address + dst_offset, size);
+   ++part->counts.writes;
+   part->counts.write_bytes += size;
+   return ESP_OK; }
+
+esp_err_t
+esp_partition_erase_range (const esp_partition_t *partition, size_t offset, size_t size) {
+   struct flashhost_part_t *part = find_part(partition);
+   if (!part)
+      return ESP_ERR_INVALID_ARG;
+   if (offset % FLASHHOST_SECTOR != 0 || size % FLASHHOST_SECTOR != 0)
+      return ESP_ERR_INVALID_SIZE;
+   if (offset > partition->size || size > partition->size - offset)
+      return ESP_ERR_INVALID_SIZE;
+   if (poweroff)
+      return ESP_FAIL;
+   memset(part->mem + offset, 0xff, size);
+   clock_us += erase_cost(partition->address + offset, size);
+   ++part->counts.erases;
+   part->counts.erase_bytes += size;
+   return ESP_OK; }
+
+// The partitions are already in memory, so mapping one just returns a pointer into it.
+// The handle is the partition number plus one.
+esp_err_t
+esp_partition_mmap (const esp_partition_t *partition, size_t offset, size_t size,
+                    esp_partition_mmap_memory_t memory, const void **out_ptr, esp_partition_mmap_handle_t *out_handle) {
+   struct flashhost_part_t *part = find_part(partition);
+   if (!part || memory != ESP_PARTITION_MMAP_DATA)
+      return ESP_ERR_INVALID_ARG;
+   if (offset > partition->size || size > partition->size - offset)
+      return ESP_ERR_INVALID_SIZE;
+   *out_ptr = part->mem + offset;
+   *out_handle = (esp_partition_mmap_handle_t)(part - parts) + 1;
+   clock_us += cost.call_us;
+   ++mappings;
+   return ESP_OK; }
+
+void
+esp_partition_munmap (esp_partition_mmap_handle_t handle) {
+   if (handle > 0) --mappings; }
+
+int
+flashhost_mappings (void) {
+   return mappings; }
@@ -0,0 +1,336 @@
+/* file: host/flashlog_bench.cpp
+   ------------------------------------------------------------------------------------
+   Benchmarks for esp32_flashlogs, run on the host partition emulator.
+
+   For each partition size and each legal entry data size, this creates a log and
+   measures flashlog_open on a new partition and on empty, half full, full, and
+   wrapped logs, flashlog_add while filling the log and after it has wrapped around,
+   flashlog_add_many, and reading the whole log forward and backward, in ranges, and with
+   FLASHLOG_OPT_MMAP, walking it with flashlog_read_mapped. For each it
+   gives the host time per call, the predicted device time from the emulator's cost
+   model (mean, p50, p99, and max), and the FLASH operations per call.
+
+   The output is CSV with a header line, one line per measurement, so that runs
+   can be compared with a script or a spreadsheet.
+
+     g++ -O2 -Ihost -I. host/flashlog_bench.cpp esp32_flashlogs.cpp host/esp_partition_host.cpp -pthread -o flashlog_bench
+     flashlog_bench [options] >results.csv
+        -s size,size...   the partition sizes, default 8K,64K,1M,4M
+        -d size,size...   the data sizes, default all of the legal ones, or for variable-
+                          length records the same ones, up to the biggest that fits
+        -o options        the FLASHLOG_OPT_xxx options, as a number, default 0
+        -r repeats        how many times to repeat each open, default 10
+        -q                quick: only 8K and 64K partitions
+        -t                make the entries lines of text like a device logs, added with
+                          flashlog_add_length, instead of a number in each slot; with -o
+                          0x8000 (FLASHLOG_OPT_COMPRESS) this measures the compression
+        -D                with -t and FLASHLOG_OPT_COMPRESS, give the log a dictionary of
+                          some typical lines
+   With -t it also writes a line to stderr for each log with the average bytes of text
+   in an entry and the bytes written to FLASH for each add.
+   -----------------------------------------------------------------------------------*/
+/* Copyright(c) 2021, Len Shustek
+   The MIT License(MIT)
+   Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+   and associated documentation files(the "Software"), to deal in the Software without
+   restriction, including without limitation the rights to use, copy, modify, merge, publish,
+   distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions :
+
+   The above copyright notice and this permission notice shall be included in all copies or
+   substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+   BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+   DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "esp32_flashlogs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAXLIST 32
+#define BATCH 16 // the entries per flashlog_add_many
+#define BATCHNAME "16"
+#define RANGE 64 // the entries per flashlog_read_range
+#define RANGENAME "64"
+
+// what is being benchmarked
+static const esp_partition_t *partition;
+static long partsize;
+static int datasize, options;
+static struct flashlog_state_t state;
+static int value; // the data for the next entry
+static bool text; // -t: the entries are lines of text
+static char dictionary[1024]; // -D: some typical lines, or empty
+static int dictlen;
+
+// Make the text of entry number "n", like what a device logs, and return its length, up to
+// "size". The lines repeat with different numbers in them, the way readings change.
+static int
+make_text (char *buf, int size, int n) {
+   char line[256];
+   unsigned r = (unsigned)n * 2654435761u;
+   r ^= r >> 15;
+   int length = 0;
+   switch (r >> 29) {
+   case 0: length = snprintf(line, sizeof(line), "wifi: connected to \"garden-ap\", rssi -%u dBm, channel %u",
+                                40 + r % 40, 1 + r % 11); break;
+   case 1: length = snprintf(line, sizeof(line), "sensor %u: temperature %u.%u C, humidity %u%%",
+                                r % 4, 15 + r % 20, r % 10, 30 + r % 50); break;
+   case 2: length = snprintf(line, sizeof(line), "mqtt: published %u bytes to home/garden/sensor%u/state",
+                                20 + r % 200, r % 4); break;
+   case 3: length = snprintf(line, sizeof(line), "battery %u mV, %u%% charged, %s",
+                                3300 + r % 900, r % 101, r & 1 ? "charging" : "discharging"); break;
+   case 4: length = snprintf(line, sizeof(line), "error: i2c read from device 0x%02x failed with %d, retry %u",
+                                0x40 + r % 8, -1 - (int)(r % 5), r % 3); break;
+   case 5: length = snprintf(line, sizeof(line), "heap: %u bytes free, largest block %u, minimum ever %u",
+                                100000 + r % 50000, 60000 + r % 30000, 90000 + r % 1000); break;
+   case 6: length = snprintf(line, sizeof(line), "pump: state changed from %s to %s after %u s",
+                                r & 1 ? "idle" : "running", r & 1 ? "running" : "idle", r % 3600); break;
+   default: length = snprintf(line, sizeof(line), "ota: no update at https://updates.example.com/fw/esp32/pool.bin, "
+                                 "next check in %u min", 30 + r % 30); }
+   if (length > size) length = size;
+   memcpy(buf, line, length);
+   return length; }
+
+// the start of a measurement
+static double start_ns;
+static struct flashhost_counts_t start_counts;
+
+static double
+host_ns (void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1e9 + ts.tv_nsec; }
+
+static void
+check (enum flashlog_error err, const char *what) {
+   if (err == FLASHLOG_ERR_OK) return;
+   fprintf(stderr, "%s failed with error %d (size %ld, datasize %d)\n", what, err, partsize, datasize);
+   exit(1); }
+
+static void
+start (void) {
+   flashhost_reset_records();
+   flashhost_get_counts(partition, &start_counts);
+   start_ns = host_ns(); }
+
+// finish a measurement of "count" calls recorded as "name", and print it
+static void
+finish (const char *bench, const char *name, const char *logstate, long count) {
+   double ns = host_ns() - start_ns;
+   struct flashhost_counts_t counts;
+   struct flashhost_stats_t st;
+   if (count <= 0) // nothing was done
+      return;
+   flashhost_get_counts(partition, &counts);
+   flashhost_get_stats(name, &st);
+   printf("%s,%s,%ld,%d,0x%x,%d,%ld,%.1f,%.1f,%.1f,%.1f,%.1f,%.3f,%.1f,%.3f,%.1f,%.4f\n",
+          bench, logstate, partsize, datasize, options, state.numinuse, count,
+          ns / count, st.mean_us, st.p50_us, st.p99_us, st.max_us,
+          (double)(counts.reads - start_counts.reads) / count,
+          (double)(counts.read_bytes - start_counts.read_bytes) / count,
+          (double)(counts.writes - start_counts.writes) / count,
+          (double)(counts.write_bytes - start_counts.write_bytes) / count,
+          (double)(counts.erases - start_counts.erases) / count);
+   fflush(stdout); }
+
+static void
+print_header (void) {
+   printf("bench,logstate,partsize,datasize,options,numinuse,count,host_ns,dev_us_mean,dev_us_p50,dev_us_p99,dev_us_max,"
+          "reads,read_bytes,writes,write_bytes,erases\n"); }
+
+// close and reopen the log "repeats" times
+static void
+bench_open (const char *logstate, int repeats) {
+   enum flashlog_error err;
+   check(flashlog_close(&state), "flashlog_close");
+   start();
+   for (int i = 0; i < repeats; ++i) {
+      if (i > 0) flashlog_close(&state);
+      FLASHHOST_TIMED("open", err = flashlog_open_options(NULL, datasize, options, &state));
+      check(err, "flashlog_open"); }
+   finish("open", "open", logstate, repeats);
+   if (dictlen > 0) // it has to be given again each time
+      check(flashlog_set_dictionary(&state, dictionary, dictlen), "flashlog_set_dictionary"); }
+
+static void
+bench_add (const char *logstate, long count) {
+   enum flashlog_error err;
+   long text_bytes = 0;
+   start();
+   for (long i = 0; i < count; ++i) {
+      ++value;
+      if (text) {
+         int length = make_text((char *)state.logdata, datasize, value);
+         text_bytes += length;
+         FLASHHOST_TIMED("add", err = flashlog_add_length(&state, length)); }
+      else {
+         memcpy(state.logdata, &value, datasize < (int)sizeof(value) ? datasize : sizeof(value));
+         FLASHHOST_TIMED("add", err = flashlog_add(&state)); }
+      check(err, "flashlog_add"); }
+   if (text && count > 0) {
+      struct flashhost_counts_t counts;
+      flashhost_get_counts(partition, &counts);
+      fprintf(stderr, "add %s, size %ld, datasize %d, options 0x%x: %.1f bytes of text, %.1f bytes written per entry\n",
+              logstate, partsize, datasize, options, (double)text_bytes / count,
+              (double)(counts.write_bytes - start_counts.write_bytes) / count); }
+   finish("add", "add", logstate, count); }
+
+// add about "count" entries in batches, and report the time per batch
+static void
+bench_add_many (const char *logstate, long count) {
+   enum flashlog_error err;
+   char *entries = (char *)calloc(BATCH, datasize);
+   start();
+   for (long i = 0; i < count; i += BATCH) {
+      for (int j = 0; j < BATCH; ++j) {
+         ++value;
+         if (text) { // the rest of each slot is left zero
+            memset(entries + j * datasize, 0, datasize);
+            make_text(entries + j * datasize, datasize, value); }
+         else memcpy(entries + j * datasize, &value, datasize < (int)sizeof(value) ? datasize : sizeof(value)); }
+      FLASHHOST_TIMED("add_many", err = flashlog_add_many(&state, entries, BATCH));
+      check(err, "flashlog_add_many"); }
+   finish("add_many_" BATCHNAME, "add_many", logstate, (count + BATCH - 1) / BATCH);
+   free(entries); }
+
+// read the whole log in one direction
+static void
+bench_read (bool forward) {
+   enum flashlog_error err;
+   long count = 0;
+   start();
+   if ((forward ? flashlog_goto_oldest(&state) : flashlog_goto_newest(&state)) == FLASHLOG_ERR_OK) do {
+         FLASHHOST_TIMED("read", err = flashlog_read(&state));
+         check(err, "flashlog_read");
+         ++count; }
+      while ((forward ? flashlog_goto_next(&state) : flashlog_goto_prev(&state)) == FLASHLOG_ERR_OK);
+   finish(forward ? "read_forward" : "read_backward", "read", "wrapped", count); }
+
+// read the whole log in ranges of RANGE entries, for comparison with reading it one at a time
+static void
+bench_read_range (void) {
+   enum flashlog_error err;
+   uint32_t seqno = 0;
+   int count;
+   long calls = 0;
+   if (options & (FLASHLOG_OPT_VARLEN | FLASHLOG_OPT_SUMMARY | FLASHLOG_OPT_COMMIT | FLASHLOG_OPT_COMPACT
+                  | FLASHLOG_OPT_COMPRESS))
+      return; // not supported
+   char *buf = (char *)malloc(RANGE * state.slotsize);
+   start();
+   do {
+      FLASHHOST_TIMED("read_range", err = flashlog_read_range(&state, seqno, RANGE, buf, &count, &seqno));
+      check(err, "flashlog_read_range");
+      ++calls; }
+   while (count > 0);
+   finish("read_range_" RANGENAME, "read_range", "wrapped", calls);
+   free(buf); }
+
+// with FLASHLOG_OPT_MMAP, walk the whole log with pointers into the mapped partition
+static void
+bench_read_mapped (void) {
+   const struct flashlog_entry_hdr_t *entry;
+   enum flashlog_error err;
+   long count = 0;
+   static volatile uint32_t sum; // so the entries are looked at
+   if (!state.mapped || (options & (FLASHLOG_OPT_COMPACT | FLASHLOG_OPT_COMPRESS)))
+      return;
+   start();
+   sum = 0;
+   if (flashlog_goto_oldest(&state) == FLASHLOG_ERR_OK) do {
+         FLASHHOST_TIMED("read_mapped", err = flashlog_read_mapped(&state, &entry));
+         check(err, "flashlog_read_mapped");
+         sum += entry->seqno;
+         ++count; }
+      while (flashlog_goto_next(&state) == FLASHLOG_ERR_OK);
+   finish("read_mapped_forward", "read_mapped", "wrapped", count); }
+
+static void
+bench_log (int repeats) {
+   enum flashlog_error err;
+   flashhost_remove_all();
+   if (!(partition = flashhost_add_partition("log", ESP_PARTITION_TYPE_LOG, 0, partsize, NULL))) {
+      fprintf(stderr, "can't create a %ld byte partition\n", partsize);
+      exit(1); }
+   value = 0;
+   start(); // the first open initializes the partition
+   FLASHHOST_TIMED("open", err = flashlog_open_options(NULL, datasize, options, &state));
+   if (err == FLASHLOG_ERR_BADSIZE) { // not a legal datasize with these options
+      flashhost_remove_all();
+      return; }
+   check(err, "flashlog_open");
+   finish("open", "open", "new", 1);
+   bench_open("empty", repeats);
+   // fill half the log, and then the rest, in sector-sized steps so we stop before any wrap
+   long numslots = state.numslots;
+   long per_sector = numslots / (partsize / FLASHLOG_SECTOR - 1); // the slots in each sector
+   if (options & FLASHLOG_OPT_VARLEN) { // the slots are units, so count entries instead
+      per_sector = FLASHLOG_SECTOR / ((state.hdrsize + datasize + FLASHLOG_VARLEN_UNIT - 1) & ~(FLASHLOG_VARLEN_UNIT - 1));
+      numslots = numslots / (FLASHLOG_SECTOR / state.slotsize) * per_sector; }
+   long half = numslots / per_sector / 2 * per_sector;
+   bench_add("filling", half);
+   bench_open("half", repeats);
+   bench_add("filling", numslots - half);
+   bench_open("full", repeats);
+   bench_add("wrapping", numslots);
+   bench_open("wrapped", repeats);
+   bench_add_many("wrapping", numslots);
+   bench_read(true);
+   bench_read(false);
+   bench_read_range();
+   bench_read_mapped();
+   flashlog_close(&state);
+   flashhost_remove_all(); }
+
+static int
+parse_list (const char *arg, long *list) {
+   int n = 0;
+   while (*arg && n < MAXLIST) {
+      char *end;
+      long v = strtol(arg, &end, 0);
+      if (*end == 'k' || *end == 'K') v *= 1024, ++end;
+      else if (*end == 'm' || *end == 'M') v *= 1024 * 1024, ++end;
+      list[n++] = v;
+      arg = *end == ',' ? end + 1 : end;
+      if (end == arg && *arg) break; }
+   return n; }
+
+int main (int argc, char **argv) {
+   long sizes[MAXLIST] = {8192, 65536, 1024 * 1024, 4 * 1024 * 1024 }, datasizes[MAXLIST];
+   int numsizes = 4, numdatasizes = 0, repeats = 10, opt;
+   bool use_dictionary = false;
+   while ((opt = getopt(argc, argv, "s:d:o:r:qtD")) != -1)
+      switch (opt) {
+      case 's': numsizes = parse_list(optarg, sizes); break;
+      case 'd': numdatasizes = parse_list(optarg, datasizes); break;
+      case 'o': options = (int)strtol(optarg, NULL, 0); break;
+      case 'r': repeats = atoi(optarg); break;
+      case 'q': numsizes = 2; break;
+      case 't': text = true; break;
+      case 'D': use_dictionary = true; break;
+      default:
+         fprintf(stderr, "usage: flashlog_bench [-s sizes] [-d datasizes] [-o options] [-r repeats] [-q] [-t] [-D]\n");
+         return 1; }
+   if (use_dictionary && text && (options & FLASHLOG_OPT_COMPRESS)) // some lines that aren't in the log
+      for (int n = -1; dictlen < (int)sizeof(dictionary) - 128; --n)
+         dictlen += make_text(dictionary + dictlen, sizeof(dictionary) - dictlen, n);
+   if (numdatasizes == 0) // all the powers of two less the entry header that fit in a sector
+      for (int slot = 8; slot <= FLASHLOG_SECTOR; slot *= 2)
+         if (slot > FLASHLOG_HDRSIZE(options))
+            datasizes[numdatasizes++] = slot - FLASHLOG_HDRSIZE(options);
+   if (numdatasizes > 0 && (options & FLASHLOG_OPT_SUMMARY) && (options & FLASHLOG_OPT_VARLEN))
+      datasizes[numdatasizes - 1] -= FLASHLOG_SUMMARY_SIZE; // the biggest record that fits before the summary
+   print_header();
+   for (int i = 0; i < numsizes; ++i)
+      for (int j = 0; j < numdatasizes; ++j) {
+         partsize = sizes[i];
+         datasize = (int)datasizes[j];
+         bench_log(repeats); }
+   return 0; }
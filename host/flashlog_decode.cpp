@@ -0,0 +1,266 @@
+/* file: host/flashlog_decode.cpp
+   ------------------------------------------------------------------------------------
+   Print the entries of a log partition read from a device, turning the ones added with
+   flashlog_logf back into text. Their format strings aren't in the log, only the IDs of
+   them, so it needs the program that made the log, or its source, to find them in.
+
+     g++ -O2 -Ihost -I. host/flashlog_decode.cpp esp32_flashlogs.cpp host/esp_partition_host.cpp -pthread -o flashlog_decode
+     flashlog_decode [options] image
+        -d file        the dictionary given to flashlog_set_dictionary, for a log made with
+                       FLASHLOG_OPT_COMPRESS and a dictionary; without it, the entries that
+                       used the dictionary can't be decompressed
+        -e file        a compiled program, like the sketch's .elf file: every string in it
+                       is a format string to look for
+        -s file        a source file: every string constant in it is a format string to
+                       look for
+        -t             instead of the log, print the format strings that were found, as
+                       string constants that can be given to -s later, so that logs made
+                       by an older version of the program can still be read
+        -x             show the entries that aren't from a known format string in hex
+   The image is the log partition, read from the device with something like
+        esptool.py read_flash 0x3f0000 0x10000 log.bin
+   and the datasize and options of the log are taken from its header.
+   -----------------------------------------------------------------------------------*/
+/* Copyright(c) 2021, Len Shustek
+   The MIT License(MIT)
+   Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+   and associated documentation files(the "Software"), to deal in the Software without
+   restriction, including without limitation the rights to use, copy, modify, merge, publish,
+   distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions :
+
+   The above copyright notice and this permission notice shall be included in all copies or
+   substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+   BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+   DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "esp32_flashlogs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// the format strings we know, sorted by ID once they've all been found
+struct format_t {
+   uint32_t id;
+   const char *format; };
+static struct format_t *formats = NULL;
+static int numformats = 0, maxformats = 0;
+
+static void
+usage (void) {
+   fprintf(stderr, "usage: flashlog_decode [-d dictionary] [-e program]... [-s source]... [-t] [-x] image\n");
+   exit(1); }
+
+// read a whole file into memory, with a '\0' after it
+static char *
+read_file (const char *name, long *size) {
+   FILE *f = fopen(name, "rb");
+   if (!f) {
+      fprintf(stderr, "can't open %s\n", name);
+      exit(1); }
+   fseek(f, 0, SEEK_END);
+   *size = ftell(f);
+   fseek(f, 0, SEEK_SET);
+   char *buf = (char *)malloc(*size + 1);
+   if (!buf || fread(buf, 1, *size, f) != (size_t)*size) {
+      fprintf(stderr, "can't read %s\n", name);
+      exit(1); }
+   buf[*size] = '\0';
+   fclose(f);
+   return buf; }
+
+static void
+add_format (const char *format) {
+   if (numformats == maxformats) {
+      maxformats = maxformats ? 2 * maxformats : 1024;
+      if (!(formats = (struct format_t *)realloc(formats, maxformats * sizeof(*formats)))) {
+         fprintf(stderr, "out of memory\n");
+         exit(1); } }
+   formats[numformats].id = flashlog_format_id(format);
+   formats[numformats].format = format;
+   ++numformats; }
+
+// Find the strings in a compiled program: every run of printable characters that ends
+// with a '\0'. The compiler can store a string that is the end of another one as part of
+// it, so every tail of each string is a candidate too.
+static void
+scan_program (const char *name) {
+   long size;
+   char *buf = read_file(name, &size);
+   for (long i = 0; i < size; ) {
+      long start = i;
+      while (i < size && ((buf[i] >= ' ' && buf[i] <= '~') || buf[i] == '\t' || buf[i] == '\n' || buf[i] == '\r'))
+         ++i;
+      if (i < size && buf[i] == '\0' && i > start)
+         for (long j = start; j < i; ++j)
+            add_format(buf + j);
+      ++i; } }
+
+// Parse the C string constant starting after the quote at "*p", and any that follow it,
+// which the compiler joins, into "out". Return false if it isn't finished.
+static bool
+parse_string (const char **p, char *out) {
+   const char *s = *p;
+   while (true) {
+      while (*s && *s != '"') {
+         char c = *s++;
+         if (c == '\n') return false;
+         if (c == '\\') switch (c = *s++) {
+               case 'n': c = '\n'; break;
+               case 't': c = '\t'; break;
+               case 'r': c = '\r'; break;
+               case 'a': c = '\a'; break;
+               case 'b': c = '\b'; break;
+               case 'f': c = '\f'; break;
+               case 'v': c = '\v'; break;
+               case 'x': c = (char)strtol(s, (char **)&s, 16); break;
+               case '0': case '1': case '2': case '3': case '4': case '5': case '6': case '7': {
+                  int value = c - '0';
+                  for (int n = 1; n < 3 && *s >= '0' && *s <= '7'; ++n)
+                     value = value * 8 + *s++ - '0';
+                  c = (char)value;
+                  break; }
+               case '\0': return false; }
+         *out++ = c; }
+      if (!*s) return false;
+      const char *next = s + 1;
+      while (*next == ' ' || *next == '\t' || *next == '\n' || *next == '\r')
+         ++next;
+      if (*next != '"') break;
+      s = next + 1; }
+   *out = '\0';
+   *p = s + 1;
+   return true; }
+
+// find the string constants in a source file, skipping comments and character constants
+static void
+scan_source (const char *name) {
+   long size;
+   const char *p = read_file(name, &size);
+   while (*p) {
+      if (p[0] == '/' && p[1] == '/') {
+         while (*p && *p != '\n') ++p; }
+      else if (p[0] == '/' && p[1] == '*') {
+         const char *end = strstr(p + 2, "*/");
+         p = end ? end + 2 : p + strlen(p); }
+      else if (*p == '\'') {
+         for (++p; *p && *p != '\'' && *p != '\n'; ++p)
+            if (*p == '\\' && p[1]) ++p;
+         if (*p) ++p; }
+      else if (*p == '"') {
+         ++p;
+         char *format = (char *)malloc(strlen(p) + 1);
+         if (parse_string(&p, format))
+            add_format(format);
+         else free(format); }
+      else ++p; } }
+
+static int
+compare_formats (const void *a, const void *b) {
+   uint32_t x = ((const struct format_t *)a)->id, y = ((const struct format_t *)b)->id;
+   return x < y ? -1 : x > y; }
+
+// print a format string as a C string constant
+static void
+print_string (const char *s) {
+   putchar('"');
+   for (; *s; ++s)
+      switch (*s) {
+      case '\n': printf("\\n"); break;
+      case '\t': printf("\\t"); break;
+      case '\r': printf("\\r"); break;
+      case '"': printf("\\\""); break;
+      case '\\': printf("\\\\"); break;
+      default:
+         if ((unsigned char)*s < ' ') printf("\\%03o", (unsigned char)*s);
+         else putchar(*s); }
+   putchar('"'); }
+
+int main (int argc, char **argv) {
+   bool table = false, hex = false;
+   const char *dictname = NULL;
+   int opt;
+   while ((opt = getopt(argc, argv, "d:e:s:tx")) != -1)
+      switch (opt) {
+      case 'd': dictname = optarg; break;
+      case 'e': scan_program(optarg); break;
+      case 's': scan_source(optarg); break;
+      case 't': table = true; break;
+      case 'x': hex = true; break;
+      default: usage(); }
+   qsort(formats, numformats, sizeof(*formats), compare_formats);
+   if (table) {
+      for (int i = 0; i < numformats; ++i)
+         if (strchr(formats[i].format, '%') && (i == 0 || strcmp(formats[i].format, formats[i - 1].format) != 0)) {
+            printf("/* %08x */ ", formats[i].id);
+            print_string(formats[i].format);
+            putchar('\n'); }
+      return 0; }
+   if (optind != argc - 1) usage();
+
+   // put the image into an emulated partition, and open the log the way it was made
+   long size;
+   char *image = read_file(argv[optind], &size);
+   struct flashlog_hdr_t hdr;
+   memcpy(&hdr, image, sizeof(hdr));
+   if (size < 2 * FLASHLOG_SECTOR || size % FLASHLOG_SECTOR != 0 || memcmp(hdr.id, FLASHLOG_ID, sizeof(hdr.id)) != 0) {
+      fprintf(stderr, "%s isn't a log partition\n", argv[optind]);
+      return 1; }
+   const esp_partition_t *partition = flashhost_add_partition("log", ESP_PARTITION_TYPE_LOG, 0, size, NULL);
+   if (!partition) {
+      fprintf(stderr, "can't create a %ld byte partition\n", size);
+      return 1; }
+   memcpy(flashhost_memory(partition), image, size);
+   struct flashlog_state_t state;
+   enum flashlog_error err = flashlog_open_options(NULL, hdr.datasize, hdr.options, &state);
+   if (err != FLASHLOG_ERR_OK) {
+      fprintf(stderr, "can't open the log: error %d\n", err);
+      return 1; }
+   if (dictname) {
+      long dictsize;
+      char *dictionary = read_file(dictname, &dictsize);
+      if (!(hdr.options & FLASHLOG_OPT_COMPRESS)) {
+         fprintf(stderr, "the log isn't compressed, so it doesn't use the dictionary %s\n", dictname);
+         return 1; }
+      if (dictsize > FLASHLOG_DICT_MAX) {
+         fprintf(stderr, "the dictionary %s is bigger than %d bytes\n", dictname, FLASHLOG_DICT_MAX);
+         return 1; }
+      flashlog_set_dictionary(&state, dictionary, (int)dictsize); }
+
+   char text[1024];
+   bool warned = false;
+   if (flashlog_goto_oldest(&state) == FLASHLOG_ERR_OK) do {
+         if ((err = flashlog_read(&state)) != FLASHLOG_ERR_OK) {
+            printf("%u: error %d\n", state.entrybuf->seqno, err);
+            if (err == FLASHLOG_ERR_BADDATA && !dictname && !warned) {
+               fprintf(stderr, "an entry can't be decompressed; if the log was made with a dictionary, give it with -d\n");
+               warned = true; }
+            continue; }
+         printf("%u: ", state.entrybuf->seqno);
+         if (hdr.options & FLASHLOG_OPT_TIMESTAMP)
+            printf("[%u] ", state.entrybuf->timestamp);
+         struct format_t key;
+         memcpy(&key.id, state.logdata, sizeof(key.id));
+         const struct format_t *found = (const struct format_t *)bsearch(&key, formats, numformats, sizeof(*formats), compare_formats);
+         int length = -1;
+         if (found) { // there could be more than one with that ID, so try them all
+            while (found > formats && found[-1].id == key.id) --found;
+            for (; found < formats + numformats && found->id == key.id && length < 0; ++found)
+               length = flashlog_format_entry(found->format, state.logdata, state.datalen, text, sizeof(text)); }
+         if (length >= 0)
+            printf("%s\n", text);
+         else if (hex) {
+            printf("unknown format %08x:", key.id);
+            for (int i = 0; i < state.datalen; ++i)
+               printf(" %02x", ((const uint8_t *)state.logdata)[i]);
+            putchar('\n'); }
+         else printf("unknown format %08x\n", key.id); }
+      while (flashlog_goto_next(&state) == FLASHLOG_ERR_OK);
+   flashlog_close(&state);
+   flashhost_remove_all();
+   return 0; }
@@ -0,0 +1,268 @@
+/* file: host/flashlog_powercut.cpp
+   ------------------------------------------------------------------------------------
+   Check what happens to a log when the power fails while entries are being added.
+   Starting from a log that has wrapped around, it adds some entries and cuts the power
+   after the first byte written, then after the second, and so on until the adds finish
+   without being cut. After each cut it turns the power back on, reopens the log, and
+   checks that every entry in it reads back as it was written, that no entry whose add
+   returned OK was lost, that a query finds them all if the log has sector summaries,
+   and that more entries can be added and read back. If the log records lengths, the
+   entries added after a cut have different lengths than the ones that were cut off.
+   With FLASHLOG_OPT_RTC (0x1) it also reopens the log from the RTC copy of its state
+   after every add while filling it, which puts the next slot everywhere in the sectors,
+   and checks that each reopen finds the same newest entry.
+
+   Without FLASHLOG_OPT_COMMIT (0x2000) it should find that some cuts leave an entry
+   that looks finished but isn't, or a slot that can't be written.
+
+     g++ -O2 -Ihost -I. host/flashlog_powercut.cpp esp32_flashlogs.cpp host/esp_partition_host.cpp -pthread -o flashlog_powercut
+     flashlog_powercut [options]
+        -s size        the partition size in bytes, default 16384 (a K or M suffix is allowed)
+        -d datasize    the entry data size, default 24
+        -o options     the FLASHLOG_OPT_xxx options, as a number, default 0x2000
+        -n entries     the entries added while the power might fail, default 40
+        -h             first fill the open hints area of the header sector, so that the
+                       adds start a sector after it is full, which starts the area over
+        -v             describe each failure
+   -----------------------------------------------------------------------------------*/
+/* Copyright(c) 2021, Len Shustek
+   The MIT License(MIT)
+   Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+   and associated documentation files(the "Software"), to deal in the Software without
+   restriction, including without limitation the rights to use, copy, modify, merge, publish,
+   distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions :
+
+   The above copyright notice and this permission notice shall be included in all copies or
+   substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+   BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+   DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "esp32_flashlogs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int datasize = 24, options = FLASHLOG_OPT_COMMIT;
+static bool verbose = false, hints = false;
+
+static void
+usage (void) {
+   fprintf(stderr, "usage: flashlog_powercut [-s size] [-d datasize] [-o options] [-n entries] [-h] [-v]\n");
+   exit(1); }
+
+static long
+size_arg (const char *arg) {
+   char *end;
+   long size = strtol(arg, &end, 0);
+   if (*end == 'k' || *end == 'K') size *= 1024;
+   else if (*end == 'm' || *end == 'M') size *= 1024 * 1024;
+   return size; }
+
+static void
+check (enum flashlog_error err, const char *what) {
+   if (err == FLASHLOG_ERR_OK) return;
+   fprintf(stderr, "%s failed with error %d\n", what, err);
+   exit(1); }
+
+// The length of each entry added, by sequence number, so it can be checked later. If the
+// log records lengths, they vary, and the entries added after a cut get different ones
+// than those added before it with the same sequence numbers, so that the entry added in
+// place of one that was cut off can fit where that one didn't.
+static int *lengths = NULL;
+static uint32_t numlengths = 0;
+static int generation = 0;
+
+static bool
+has_lengths (void) {
+   return FLASHLOG_HDRSIZE(options) > FLASHLOG_ENTRY_SEQNO_SIZE; }
+
+static int
+entry_length (uint32_t seqno) {
+   if (!has_lengths()) return datasize;
+   return seqno < numlengths ? lengths[seqno] : 0; }
+
+static int
+new_entry_length (uint32_t seqno) {
+   if (seqno >= numlengths) {
+      numlengths = numlengths ? 2 * numlengths : 1024;
+      if (!(lengths = (int *)realloc(lengths, numlengths * sizeof(int)))) {
+         fprintf(stderr, "out of memory\n");
+         exit(1); } }
+   lengths[seqno] = 1 + (seqno * 37 + generation * 1009) % datasize;
+   return entry_length(seqno); }
+
+// the data of the entry with a sequence number
+
+static uint8_t
+entry_byte (uint32_t seqno, int i) {
+   return (uint8_t)(seqno * 131 + i * 7 + 1); }
+
+// add an entry with the next sequence number
+static enum flashlog_error
+add_entry (struct flashlog_state_t *state) {
+   uint32_t seqno = state->highest_seqno + 1;
+   int length = new_entry_length(seqno);
+   for (int i = 0; i < length; ++i)
+      ((uint8_t *)state->logdata)[i] = entry_byte(seqno, i);
+   return flashlog_add_length(state, length); }
+
+// Add an entry while filling the log. With FLASHLOG_OPT_RTC, close and reopen the log
+// after it, which restores the state from the RTC copy, and check that it agrees.
+static void
+fill_entry (struct flashlog_state_t *state) {
+   check(add_entry(state), "flashlog_add");
+   if (!(options & FLASHLOG_OPT_RTC)) return;
+   uint32_t highest = state->highest_seqno;
+   int newest = state->newest, numinuse = state->numinuse;
+   check(flashlog_close(state), "flashlog_close");
+   check(flashlog_open_options(NULL, datasize, options, state), "reopening from the RTC copy");
+   if (state->highest_seqno != highest || state->newest != newest || state->numinuse != numinuse) {
+      fprintf(stderr, "reopening from the RTC copy after entry %u found entry %u in slot %d, not slot %d\n",
+              highest, state->highest_seqno, state->newest, newest);
+      exit(1); } }
+
+// Check every entry in the log, oldest first, and return the number that are wrong. The
+// sequence numbers must be increasing, and the newest must be at least "newest".
+static int
+verify (struct flashlog_state_t *state, uint32_t newest, long cut, const char *when) {
+   int bad = 0;
+   uint32_t last = 0;
+   int count = 0;
+   if (flashlog_goto_oldest(state) == FLASHLOG_ERR_OK) do {
+         enum flashlog_error err = flashlog_read(state);
+         uint32_t seqno = state->entrybuf->seqno;
+         if (err != FLASHLOG_ERR_OK) {
+            if (verbose) printf("cut at byte %ld, %s: error %d reading entry %d\n", cut, when, err, count);
+            ++bad;
+            continue; }
+         int length = entry_length(seqno);
+         bool ok = count == 0 || seqno > last;
+         if (has_lengths())
+            ok = ok && state->datalen == length;
+         for (int i = 0; ok && i < length; ++i)
+            ok = ((const uint8_t *)state->logdata)[i] == entry_byte(seqno, i);
+         if (!ok) {
+            if (verbose) printf("cut at byte %ld, %s: entry %d with seqno %u is wrong\n", cut, when, count, seqno);
+            ++bad; }
+         last = seqno;
+         ++count; }
+      while (flashlog_goto_next(state) == FLASHLOG_ERR_OK);
+   if (count == 0 || last < newest) {
+      if (verbose) printf("cut at byte %ld, %s: the newest entry is %u, not at least %u\n", cut, when, last, newest);
+      ++bad; }
+   if (options & FLASHLOG_OPT_SUMMARY) { // a query for everything must find every entry
+      struct flashlog_query_t all = FLASHLOG_QUERY_ALL;
+      int found = 0;
+      for (enum flashlog_error err = flashlog_query_first(state, &all); err == FLASHLOG_ERR_OK;
+            err = flashlog_query_next(state, &all))
+         ++found;
+      if (found != count) {
+         if (verbose) printf("cut at byte %ld, %s: a query found %d of the %d entries\n", cut, when, found, count);
+         ++bad; } }
+   return bad; }
+
+int main (int argc, char **argv) {
+   long size = 16384;
+   int entries = 40, opt;
+   while ((opt = getopt(argc, argv, "s:d:o:n:hv")) != -1)
+      switch (opt) {
+      case 's': size = size_arg(optarg); break;
+      case 'd': datasize = atoi(optarg); break;
+      case 'o': options = (int)strtol(optarg, NULL, 0); break;
+      case 'n': entries = atoi(optarg); break;
+      case 'h': hints = true; break;
+      case 'v': verbose = true; break;
+      default: usage(); }
+   const esp_partition_t *partition = flashhost_add_partition("log", ESP_PARTITION_TYPE_LOG, 0, size, NULL);
+   if (!partition) {
+      fprintf(stderr, "can't create a %ld byte partition\n", size);
+      return 1; }
+   uint8_t *memory = flashhost_memory(partition);
+   uint8_t *snapshot = (uint8_t *)malloc(size);
+
+   // fill the log until it has wrapped around, and save a copy of it
+   struct flashlog_state_t state;
+   struct flashhost_counts_t counts;
+   check(flashlog_open_options(NULL, datasize, options, &state), "flashlog_open");
+   while (state.numinuse == 0 || state.oldest == 0 || state.highest_seqno < (uint32_t)state.numslots)
+      fill_entry(&state);
+   if (hints) {
+      // fill the hints area, then see how many adds it takes to start the next sector,
+      // and stop about halfway through the adds before that
+      while (state.nexthint < FLASHLOG_NUMHINTS)
+         fill_entry(&state);
+      int per_sector = state.numslots / (int)(size / FLASHLOG_SECTOR - 1);
+      check(flashlog_close(&state), "flashlog_close");
+      memcpy(snapshot, memory, size);
+      check(flashlog_open_options(NULL, datasize, options, &state), "flashlog_open");
+      int sector = state.newest / per_sector, before = 0;
+      for (; state.newest / per_sector == sector; ++before)
+         check(add_entry(&state), "flashlog_add");
+      check(flashlog_close(&state), "flashlog_close");
+      memcpy(memory, snapshot, size);
+      check(flashlog_open_options(NULL, datasize, options, &state), "flashlog_open");
+      for (int i = 0; i < before - entries / 2; ++i)
+         check(add_entry(&state), "flashlog_add"); }
+   check(flashlog_close(&state), "flashlog_close");
+   memcpy(snapshot, memory, size);
+
+   // find out how many bytes the adds write when the power doesn't fail
+   check(flashlog_open_options(NULL, datasize, options, &state), "flashlog_open");
+   flashhost_reset_counts(partition);
+   for (int i = 0; i < entries; ++i)
+      check(add_entry(&state), "flashlog_add");
+   flashhost_get_counts(partition, &counts);
+   check(flashlog_close(&state), "flashlog_close");
+   long total = (long)counts.write_bytes;
+
+   long failures = 0;
+   for (long cut = 0; cut < total; ++cut) {
+      memcpy(memory, snapshot, size);
+      check(flashlog_open_options(NULL, datasize, options, &state), "flashlog_open");
+      generation = 0;
+      flashhost_set_powercut(cut);
+      uint32_t acked = state.highest_seqno; // the seqno of the last add that worked
+      for (int i = 0; i < entries && add_entry(&state) == FLASHLOG_ERR_OK; ++i)
+         acked = state.highest_seqno;
+      flashhost_set_powercut(-1);
+      flashlog_close(&state);
+      generation = (int)cut + 1;
+
+      int bad = 0;
+      flashhost_reset_counts(partition);
+      enum flashlog_error err = flashlog_open_options(NULL, datasize, options, &state);
+      flashhost_get_counts(partition, &counts);
+      if (err != FLASHLOG_ERR_OK || counts.writes != 0 || counts.erases != 0) {
+         if (verbose) printf("cut at byte %ld: reopening got error %d and did %ld writes and %ld erases\n",
+                                cut, err, counts.writes, counts.erases);
+         ++failures;
+         if (err != FLASHLOG_ERR_OK) continue; }
+      bad += verify(&state, acked, cut, "after reopening");
+
+      // the log must still work: the adds must not hit bits that can't be programmed
+      for (int i = 0; i < entries && bad == 0; ++i)
+         if ((err = add_entry(&state)) != FLASHLOG_ERR_OK) {
+            if (verbose) printf("cut at byte %ld: adding after reopening got error %d\n", cut, err);
+            ++bad; }
+      if (bad == 0)
+         bad += verify(&state, state.highest_seqno, cut, "after adding more");
+      uint32_t highest = state.highest_seqno;
+      flashlog_close(&state);
+      if (bad == 0) {
+         check(flashlog_open_options(NULL, datasize, options, &state), "flashlog_open");
+         bad += verify(&state, highest, cut, "after reopening again");
+         flashlog_close(&state); }
+      if (bad) ++failures; }
+
+   printf("partition %ld bytes, datasize %d, options 0x%x, %d entries: %ld of %ld power cuts failed\n",
+          size, datasize, options, entries, failures, total);
+   free(snapshot);
+   free(lengths);
+   flashhost_remove_all();
+   return failures != 0; }
@@ -0,0 +1,125 @@
+/* file: host/flashlog_predict.cpp
+   ------------------------------------------------------------------------------------
+   Predict how long the flashlog_xxx calls will take on the device for a duty cycle:
+   open the log, add some entries, read them all back, and close it, some number of
+   times, using the cost model of the host partition emulator. It prints the predicted
+   time of each kind of call, with p50/p99/max, so you can size a log before
+   putting it on a device.
+
+     g++ -O2 -Ihost -I. host/flashlog_predict.cpp esp32_flashlogs.cpp host/esp_partition_host.cpp -pthread -o flashlog_predict
+     flashlog_predict [options]
+        -s size        the partition size in bytes, default 65536 (a K or M suffix is allowed)
+        -d datasize    the entry data size, default 28
+        -o options     the FLASHLOG_OPT_xxx options, as a number, default 0
+        -a adds        the entries added per cycle, default 100
+        -c cycles      the number of open/add/read/close cycles, default 50
+        -m             call flashlog_maintain after each add
+        -r             don't read the log back in each cycle
+        -C call_us,read_mbps,write_mbps,program_us,erase4k_us,erase32k_us,erase64k_us
+                       change the cost model; empty fields keep the defaults
+   -----------------------------------------------------------------------------------*/
+/* Copyright(c) 2021, Len Shustek
+   The MIT License(MIT)
+   Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+   and associated documentation files(the "Software"), to deal in the Software without
+   restriction, including without limitation the rights to use, copy, modify, merge, publish,
+   distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions :
+
+   The above copyright notice and this permission notice shall be included in all copies or
+   substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+   BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+   DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "esp32_flashlogs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void
+usage (void) {
+   fprintf(stderr, "usage: flashlog_predict [-s size] [-d datasize] [-o options] [-a adds] [-c cycles] [-m] [-r]\n"
+                   "                        [-C call_us,read_mbps,write_mbps,program_us,erase4k_us,erase32k_us,erase64k_us]\n");
+   exit(1); }
+
+static long
+size_arg (const char *arg) {
+   char *end;
+   long size = strtol(arg, &end, 0);
+   if (*end == 'k' || *end == 'K') size *= 1024;
+   else if (*end == 'm' || *end == 'M') size *= 1024 * 1024;
+   return size; }
+
+// change the cost model from a list of numbers, any of which may be left out
+static void
+cost_arg (const char *arg) {
+   struct flashhost_cost_t cost;
+   flashhost_get_cost(&cost);
+   double *fields[] = {&cost.call_us, &cost.read_mbps, &cost.write_mbps, &cost.program_us,
+                       &cost.erase4k_us, &cost.erase32k_us, &cost.erase64k_us };
+   for (unsigned i = 0; i < sizeof(fields) / sizeof(fields[0]) && *arg; ++i) {
+      char *end;
+      double value = strtod(arg, &end);
+      if (end != arg) *fields[i] = value;
+      arg = *end == ',' ? end + 1 : end; }
+   flashhost_set_cost(&cost); }
+
+static void
+check (enum flashlog_error err, const char *what) {
+   if (err == FLASHLOG_ERR_OK) return;
+   fprintf(stderr, "%s failed with error %d\n", what, err);
+   exit(1); }
+
+int main (int argc, char **argv) {
+   long size = 65536;
+   int datasize = 28, options = 0, adds = 100, cycles = 50, opt;
+   bool maintain = false, readback = true;
+   while ((opt = getopt(argc, argv, "s:d:o:a:c:mrC:")) != -1)
+      switch (opt) {
+      case 's': size = size_arg(optarg); break;
+      case 'd': datasize = atoi(optarg); break;
+      case 'o': options = (int)strtol(optarg, NULL, 0); break;
+      case 'a': adds = atoi(optarg); break;
+      case 'c': cycles = atoi(optarg); break;
+      case 'm': maintain = true; break;
+      case 'r': readback = false; break;
+      case 'C': cost_arg(optarg); break;
+      default: usage(); }
+   if (!flashhost_add_partition("log", ESP_PARTITION_TYPE_LOG, 0, size, NULL)) {
+      fprintf(stderr, "can't create a %ld byte partition\n", size);
+      return 1; }
+
+   struct flashlog_state_t state;
+   enum flashlog_error err;
+   int value = 0;
+   double start_us = flashhost_clock_us();
+   for (int cycle = 0; cycle < cycles; ++cycle) {
+      FLASHHOST_TIMED("flashlog_open", err = flashlog_open_options(NULL, datasize, options, &state));
+      check(err, "flashlog_open");
+      for (int i = 0; i < adds; ++i) {
+         memset(state.logdata, 0, datasize);
+         ++value;
+         memcpy(state.logdata, &value, datasize < (int)sizeof(value) ? datasize : sizeof(value));
+         FLASHHOST_TIMED("flashlog_add", err = flashlog_add(&state));
+         check(err, "flashlog_add");
+         if (maintain) {
+            FLASHHOST_TIMED("flashlog_maintain", err = flashlog_maintain(&state));
+            check(err, "flashlog_maintain"); } }
+      if (readback) { // read the whole log, oldest first
+         if (flashlog_goto_oldest(&state) == FLASHLOG_ERR_OK) do {
+               FLASHHOST_TIMED("flashlog_read", err = flashlog_read(&state));
+               check(err, "flashlog_read"); }
+            while (flashlog_goto_next(&state) == FLASHLOG_ERR_OK); }
+      FLASHHOST_TIMED("flashlog_close", err = flashlog_close(&state));
+      check(err, "flashlog_close"); }
+
+   printf("partition %ld bytes, datasize %d, options 0x%x, %d cycles of %d adds\n", size, datasize, options, cycles, adds);
+   flashhost_report(stdout);
+   printf("total predicted device time %.1f ms\n", (flashhost_clock_us() - start_us) / 1000);
+   flashhost_remove_all();
+   return 0; }
@@ -0,0 +1,148 @@
+/* file: host/flashlog_typed_test.cpp
+   ------------------------------------------------------------------------------------
+   Check the FlashLog<T> template of esp32_flashlogs_typed.h on the host partition
+   emulator: adding entries one at a time and in batches, reading them with range-based
+   for loops oldest first, newest first, and between two times, after the log has wrapped
+   around and after it has been reopened, and with FLASHLOG_OPT_COMPACT. It prints "ok",
+   or what went wrong and exits with 1.
+
+     g++ -O2 -Ihost -I. host/flashlog_typed_test.cpp esp32_flashlogs.cpp host/esp_partition_host.cpp -pthread -o flashlog_typed_test
+     flashlog_typed_test
+   -----------------------------------------------------------------------------------*/
+/* Copyright(c) 2021, Len Shustek
+   The MIT License(MIT)
+   Permission is hereby granted, free of charge, to any person obtaining a copy of this software
+   and associated documentation files(the "Software"), to deal in the Software without
+   restriction, including without limitation the rights to use, copy, modify, merge, publish,
+   distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the
+   Software is furnished to do so, subject to the following conditions :
+
+   The above copyright notice and this permission notice shall be included in all copies or
+   substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING
+   BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT.IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+   DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+   FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "esp32_flashlogs_typed.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+struct event_t { uint32_t number; int16_t code, value; };
+struct reading_t { uint16_t value; };            // 2 bytes, so compact slots are 4
+struct record_t { uint32_t number; char text[24]; }; // exactly fills a 32-byte slot
+
+static_assert(!std::is_copy_constructible<FlashLog<event_t>>::value, "a FlashLog mustn't be copied");
+static_assert(FlashLog<event_t>::datasize == 12, "an 8-byte entry goes in a 16-byte slot");
+static_assert(FlashLog<reading_t, FLASHLOG_OPT_COMPACT>::datasize == 4, "compact slots are a multiple of 4");
+
+static void
+check (bool ok, const char *what) {
+   if (ok) return;
+   printf("failed: %s\n", what);
+   exit(1); }
+
+static void
+check (enum flashlog_error err, const char *what) {
+   if (err == FLASHLOG_ERR_OK) return;
+   printf("%s failed with error %d\n", what, err);
+   exit(1); }
+
+// check that the log has the entries numbered from "first" to "last", both ways
+static void
+check_events (FlashLog<event_t> &log, uint32_t first, uint32_t last) {
+   uint32_t expect = first;
+   for (event_t e : log) {
+      check(e.number == expect && e.code == (int16_t)(expect % 7) && e.value == (int16_t)-(int)expect, "reading oldest first");
+      ++expect; }
+   check(expect == last + 1, "the number of entries read oldest first");
+   for (const event_t &e : log.newest_first()) {
+      check(e.number == --expect, "reading newest first"); }
+   check(expect == first, "the number of entries read newest first");
+   check(log.count() == (int)(last - first + 1), "count()"); }
+
+static void
+test_events (void) {
+   FlashLog<event_t> log;
+   check(log.open(), "open");
+   for (uint32_t i = 1; i <= 100; ++i)
+      check(log.add(event_t{i, (int16_t)(i % 7), (int16_t)-(int)i}), "add");
+   check_events(log, 1, 100);
+   // fill it until it wraps around, so the oldest sector has been erased
+   uint32_t i = 101;
+   for (; log.state.highest_seqno < (uint32_t)log.state.numslots + 300; ++i)
+      check(log.add(event_t{i, (int16_t)(i % 7), (int16_t)-(int)i}), "add");
+   check(log.count() < log.state.numslots, "the log wrapped around");
+   check_events(log, i - log.count(), i - 1);
+   check(log.close(), "close");
+   check(log.open(), "reopen");
+   check_events(log, i - log.count(), i - 1);
+   check(log.goto_seqno(i - 5), "goto_seqno");
+   event_t e;
+   check(log.read(&e), "read");
+   check(e.number == i - 5, "the entry from goto_seqno");
+   check(log.close(), "close"); }
+
+static void
+test_times (void) {
+   FlashLog<event_t, FLASHLOG_OPT_TIMESTAMP> log;
+   check(log.open(), "open with timestamps");
+   for (uint32_t i = 1; i <= 500; ++i)
+      check(log.add(event_t{i, 0, 0}, 1000 + 10 * i), "add with a timestamp");
+   uint32_t expect = 20;
+   for (event_t e : log.between(1000 + 195, 1000 + 300)) {
+      check(e.number == expect && log.timestamp() == 1000 + 10 * expect, "reading between two times");
+      ++expect; }
+   check(expect == 31, "the number of entries between two times");
+   int n = 0;
+   for (event_t e : log.between(1000 + 5001, 1000 + 6000)) {
+      (void)e;
+      ++n; }
+   check(n == 0, "no entries after the newest");
+   check(log.close(), "close"); }
+
+static void
+test_compact (void) {
+   FlashLog<reading_t, FLASHLOG_OPT_COMPACT> log;
+   check(log.open(), "open compact");
+   for (int i = 0; i < 3000; ++i) // including one that is all 0xff
+      check(log.add(reading_t{(uint16_t)(i == 1234 ? 0xffff : i)}), "add compact");
+   int expect = 3000 - log.count();
+   for (reading_t r : log) {
+      check(r.value == (expect == 1234 ? 0xffff : expect), "reading compact entries");
+      ++expect; }
+   check(expect == 3000, "the number of compact entries");
+   for (reading_t r : log.newest_first())
+      check(r.value == (--expect == 1234 ? 0xffff : expect), "reading compact entries newest first");
+   check(log.close(), "close"); }
+
+static void
+test_many (void) {
+   FlashLog<record_t> log;
+   record_t records[50];
+   check(log.open(), "open for add_many");
+   for (uint32_t i = 0; i < 50; ++i) {
+      records[i].number = i;
+      snprintf(records[i].text, sizeof(records[i].text), "record %u", i); }
+   check(log.add_many(records, 50), "add_many");
+   uint32_t expect = 0;
+   for (record_t r : log) {
+      check(r.number == expect && strcmp(r.text, records[expect].text) == 0, "reading entries from add_many");
+      ++expect; }
+   check(expect == 50, "the number of entries from add_many");
+   check(log.close(), "close"); }
+
+int main (void) {
+   if (!flashhost_add_partition("log", ESP_PARTITION_TYPE_LOG, 0, 64 * 1024, NULL)) {
+      printf("can't create the partition\n");
+      return 1; }
+   flashhost_set_strict(true);
+   test_events();
+   test_times();
+   test_compact();
+   test_many();
+   flashhost_remove_all();
+   printf("ok\n");
+   return 0; }